@@ -0,0 +1,362 @@
+//
+// Lock-striped concurrent variant of the recursive hash map
+//
+#pragma once
+
+#include "HashMap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+const size_t DEFAULT_STRIPES = 64; // rounded up to a power of two
+
+// what one stripe has been through, to spot imbalance and resize stalls confined to a stripe
+struct StripeStats {
+    size_t size = 0;
+    size_t lock_acquisitions = 0;
+    size_t contended_acquisitions = 0; // the lock was held by another thread
+    uint64_t longest_write_ns = 0; // the longest a write kept the lock, Expand/Reduce included
+};
+
+// the top bits of a remix of its own, independent of the cells and tags a stripe's map takes from the hash
+inline size_t StripeIndex(size_t hash, uint8_t stripe_bits) {
+    if (stripe_bits == 0) {
+        return 0;
+    }
+    return static_cast<size_t>((static_cast<uint64_t>(hash) * 0xff51afd7ed558ccdull) >> (64 - stripe_bits));
+}
+
+// The root cell array is fixed: a key always belongs to the same stripe, and every stripe is a whole
+// HashMap behind its own lock. Inserts, erases and the Expand/Reduce they trigger only stall the threads
+// that hit the same stripe, lookups take the lock shared. Elements are never handed out by reference,
+// values are copied out or accessed inside a callback while the stripe is locked. Every stripe's map
+// takes the Policy (cell counts, leaf size, seed) of the whole map. The batch operations hash every key
+// once, group the keys by stripe and take each lock once per batch.
+template<typename KeyType, typename ValueType,
+        typename Hash = std::hash<KeyType>,
+        typename KeyEqual = std::equal_to<KeyType>,
+        typename Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+        typename Policy = DefaultPolicy>
+class ConcurrentHashMap {
+    using Map = HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+    using Clock = std::chrono::steady_clock;
+
+    // a cache line per stripe, so the locks of neighbouring stripes do not share one
+    struct alignas(64) Stripe {
+        Stripe(const Hash& hash, const KeyEqual& equal, const Allocator& alloc) : map(hash, equal, alloc) {}
+
+        mutable std::shared_mutex mutex;
+        Map map;
+        // readers count under the shared lock, so the counters are atomic
+        mutable std::atomic<size_t> lock_acquisitions{0};
+        mutable std::atomic<size_t> contended_acquisitions{0};
+        uint64_t longest_write_ns = 0;
+    };
+
+    // the stripes are built in place: a map assigned into a stripe would keep the allocator it was
+    // default-constructed with when the allocator does not propagate (std::pmr::polymorphic_allocator)
+    struct StripesDeleter {
+        size_t count;
+        size_t built; // constructed so far, the constructor of a map may throw
+
+        void operator()(Stripe* stripes) const noexcept {
+            for (size_t i = 0; i < built; ++i) {
+                stripes[i].~Stripe();
+            }
+            std::allocator<Stripe>().deallocate(stripes, count);
+        }
+    };
+
+    // the shared lock of a stripe, counted in its stats
+    class ReadLock {
+    public:
+        explicit ReadLock(const Stripe& stripe) : stripe(stripe) {
+            if (!stripe.mutex.try_lock_shared()) {
+                stripe.mutex.lock_shared();
+                stripe.contended_acquisitions.fetch_add(1, std::memory_order_relaxed);
+            }
+            stripe.lock_acquisitions.fetch_add(1, std::memory_order_relaxed);
+        }
+        ReadLock(const ReadLock&) = delete;
+        ReadLock& operator=(const ReadLock&) = delete;
+        ~ReadLock() {
+            stripe.mutex.unlock_shared();
+        }
+
+    private:
+        const Stripe& stripe;
+    };
+
+    // the exclusive lock of a stripe, counted in its stats with how long it was held
+    class WriteLock {
+    public:
+        explicit WriteLock(Stripe& stripe) : stripe(stripe) {
+            if (!stripe.mutex.try_lock()) {
+                stripe.mutex.lock();
+                stripe.contended_acquisitions.fetch_add(1, std::memory_order_relaxed);
+            }
+            stripe.lock_acquisitions.fetch_add(1, std::memory_order_relaxed);
+            start = Clock::now();
+        }
+        WriteLock(const WriteLock&) = delete;
+        WriteLock& operator=(const WriteLock&) = delete;
+        ~WriteLock() {
+            uint64_t held = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+            stripe.longest_write_ns = std::max(stripe.longest_write_ns, held);
+            stripe.mutex.unlock();
+        }
+
+    private:
+        Stripe& stripe;
+        Clock::time_point start;
+    };
+
+public:
+    explicit ConcurrentHashMap(size_t stripes = DEFAULT_STRIPES, const Hash& hash = Hash(),
+                               const KeyEqual& equal = KeyEqual(), const Allocator& alloc = Allocator()) :
+            hasher(hash) {
+        while (stripe_count() < stripes) {
+            ++stripe_bits;
+        }
+        Stripe* stripes_memory = std::allocator<Stripe>().allocate(stripe_count());
+        stripes_data = std::unique_ptr<Stripe[], StripesDeleter>(stripes_memory, StripesDeleter{stripe_count(), 0});
+        for (size_t& built = stripes_data.get_deleter().built; built < stripe_count(); ++built) {
+            new (&stripes_memory[built]) Stripe(hash, equal, alloc);
+        }
+    }
+
+    ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+    ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+    size_t stripe_count() const {
+        return size_t(1) << stripe_bits;
+    }
+
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    size_t stripe_of(const KeyType& key) const {
+        return StripeIndex(hasher(key), stripe_bits);
+    }
+
+    bool insert(const std::pair<const KeyType, ValueType>& add) {
+        size_t hash = hasher(add.first);
+        Stripe& stripe = StripeOf(hash);
+        WriteLock lock(stripe);
+        return stripe.map.insert(add, hash);
+    }
+
+    bool insert(std::pair<const KeyType, ValueType>&& add) {
+        size_t hash = hasher(add.first);
+        Stripe& stripe = StripeOf(hash);
+        WriteLock lock(stripe);
+        return stripe.map.insert(std::move(add), hash);
+    }
+
+    // returns true if inserted, false if assigned
+    template<class M>
+    bool insert_or_assign(const KeyType& key, M&& obj) {
+        size_t hash = hasher(key);
+        Stripe& stripe = StripeOf(hash);
+        WriteLock lock(stripe);
+        auto it = stripe.map.find(key, hash);
+        if (it != stripe.map.end()) {
+            it->second = std::forward<M>(obj);
+            return false;
+        }
+        return stripe.map.insert({key, std::forward<M>(obj)}, hash);
+    }
+
+    bool erase(const KeyType& key) {
+        size_t hash = hasher(key);
+        Stripe& stripe = StripeOf(hash);
+        WriteLock lock(stripe);
+        return stripe.map.erase(key, hash);
+    }
+
+    bool contains(const KeyType& key) const {
+        size_t hash = hasher(key);
+        const Stripe& stripe = StripeOf(hash);
+        ReadLock lock(stripe);
+        return static_cast<const Map&>(stripe.map).contains(key, hash);
+    }
+
+    size_t count(const KeyType& key) const {
+        return contains(key) ? 1 : 0;
+    }
+
+    // copies the value to value if the key is present
+    bool find(const KeyType& key, ValueType& value) const {
+        return cvisit(key, [&](const ValueType& found) {
+            value = found;
+        });
+    }
+
+    // f(ValueType&) runs under the exclusive lock of the stripe; false if the key is absent
+    template<class F>
+    bool visit(const KeyType& key, F f) {
+        size_t hash = hasher(key);
+        Stripe& stripe = StripeOf(hash);
+        WriteLock lock(stripe);
+        auto it = stripe.map.find(key, hash);
+        if (it == stripe.map.end()) {
+            return false;
+        }
+        f(it->second);
+        return true;
+    }
+
+    // f(const ValueType&) runs under the shared lock of the stripe
+    template<class F>
+    bool cvisit(const KeyType& key, F f) const {
+        size_t hash = hasher(key);
+        const Stripe& stripe = StripeOf(hash);
+        ReadLock lock(stripe);
+        const Map& map = stripe.map;
+        auto it = map.find(key, hash);
+        if (it == map.end()) {
+            return false;
+        }
+        f(it->second);
+        return true;
+    }
+
+    // [first, last) of pairs, moved into the map when the iterator yields rvalues (std::move_iterator);
+    // returns the number of inserted elements
+    template<class Iterator>
+    size_t insert_batch(Iterator first, Iterator last) {
+        size_t inserted = 0;
+        ForEachStripe(first, last, [](const auto& element) -> const KeyType& {
+            return element.first;
+        }, [&](Map& map, auto&& element, size_t hash) {
+            using Element = decltype(element);
+            inserted += map.insert(std::pair<const KeyType, ValueType>(std::forward<Element>(element)), hash);
+        });
+        return inserted;
+    }
+
+    // [first, last) of keys; returns the number of erased elements
+    template<class Iterator>
+    size_t erase_batch(Iterator first, Iterator last) {
+        size_t erased = 0;
+        ForEachStripe(first, last, [](const KeyType& key) -> const KeyType& {
+            return key;
+        }, [&](Map& map, const KeyType& key, size_t hash) {
+            erased += map.erase(key, hash);
+        });
+        return erased;
+    }
+
+    // stripe by stripe, so it is not a snapshot when other threads write
+    size_t size() const {
+        size_t result = 0;
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            std::shared_lock<std::shared_mutex> lock(stripes_data[i].mutex);
+            result += stripes_data[i].map.size();
+        }
+        return result;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            WriteLock lock(stripes_data[i]);
+            stripes_data[i].map.clear();
+        }
+    }
+
+    // f(const std::pair<const KeyType, ValueType>&) for every element, one stripe locked at a time
+    template<class F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            ReadLock lock(stripes_data[i]);
+            const Map& map = stripes_data[i].map;
+            for (const auto& element : map) {
+                f(element);
+            }
+        }
+    }
+
+    // reading the stats is not counted in them
+    std::vector<StripeStats> stripe_stats() const {
+        std::vector<StripeStats> result(stripe_count());
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            const Stripe& stripe = stripes_data[i];
+            std::shared_lock<std::shared_mutex> lock(stripe.mutex);
+            result[i].size = stripe.map.size();
+            result[i].lock_acquisitions = stripe.lock_acquisitions.load(std::memory_order_relaxed);
+            result[i].contended_acquisitions = stripe.contended_acquisitions.load(std::memory_order_relaxed);
+            result[i].longest_write_ns = stripe.longest_write_ns;
+        }
+        return result;
+    }
+
+    void reset_stripe_stats() {
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            Stripe& stripe = stripes_data[i];
+            std::unique_lock<std::shared_mutex> lock(stripe.mutex);
+            stripe.lock_acquisitions.store(0, std::memory_order_relaxed);
+            stripe.contended_acquisitions.store(0, std::memory_order_relaxed);
+            stripe.longest_write_ns = 0;
+        }
+    }
+
+private:
+    Stripe& StripeOf(size_t hash) {
+        return stripes_data[StripeIndex(hash, stripe_bits)];
+    }
+
+    const Stripe& StripeOf(size_t hash) const {
+        return stripes_data[StripeIndex(hash, stripe_bits)];
+    }
+
+    // hashes every element once, orders them by stripe (counting sort) and applies apply(map, element, hash)
+    // to the elements of each stripe under a single lock
+    template<class Iterator, class KeyOf, class Apply>
+    void ForEachStripe(Iterator first, Iterator last, KeyOf key_of, Apply apply) {
+        std::vector<Iterator> elements;
+        std::vector<size_t> hashes;
+        std::vector<uint32_t> stripe_ids;
+        for (; first != last; ++first) {
+            size_t hash = hasher(key_of(*first));
+            elements.push_back(first);
+            hashes.push_back(hash);
+            stripe_ids.push_back(static_cast<uint32_t>(StripeIndex(hash, stripe_bits)));
+        }
+        std::vector<size_t> begin(stripe_count() + 1);
+        for (uint32_t id : stripe_ids) {
+            ++begin[id + 1];
+        }
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            begin[i + 1] += begin[i];
+        }
+        std::vector<size_t> order(elements.size());
+        std::vector<size_t> next(stripe_count());
+        for (size_t i = 0; i < elements.size(); ++i) {
+            order[begin[stripe_ids[i]] + next[stripe_ids[i]]++] = i;
+        }
+        for (size_t stripe = 0; stripe < stripe_count(); ++stripe) {
+            if (begin[stripe] == begin[stripe + 1]) {
+                continue;
+            }
+            WriteLock lock(stripes_data[stripe]);
+            for (size_t i = begin[stripe]; i < begin[stripe + 1]; ++i) {
+                apply(stripes_data[stripe].map, *elements[order[i]], hashes[order[i]]);
+            }
+        }
+    }
+
+    Hash hasher;
+    uint8_t stripe_bits = 0;
+    std::unique_ptr<Stripe[], StripesDeleter> stripes_data;
+};
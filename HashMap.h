@@ -4,28 +4,53 @@
 //
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iterator>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <random>
+#include <set>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "ThreadPool.h"
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HASH_MAP_X86_SIMD
+#include <immintrin.h>
+#endif
 
+// tuning of DefaultPolicy, a HashMap takes its own from its Policy parameter
 const uint8_t MAX_RECURSIVE_LEVEL = 5; //0..9
 const uint8_t MAX_SIZE_ID = 16;
 const uint8_t MAX_SIZE_DIV_NUMBER_OF_ELEMENTS = 4; // the number of elements is 10 times less than the max_size
+const uint8_t MAX_LEVELS = 8; // upper bound of MAX_RECURSIVE_LEVEL of any policy
+const uint8_t MIGRATION_CELLS_PER_OPERATION = 8; // incremental resize: old root cells moved by every insert and erase
+const size_t PREPARED_CELLS_PER_OPERATION = 256; // incremental resize: new root cells zeroed by every insert and erase
+const uint8_t BATCH_SIZE = 16; // find_batch: keys whose paths down the tree are walked in lock-step
+const uint8_t MAX_IN_FLIGHT = 64; // find_interleaved: upper bound of the lookups kept in progress
+const size_t PARALLEL_BUILD_MIN = 1 << 16; // parallel construction: smaller inputs are inserted one by one
+const size_t PARALLEL_TASKS_PER_THREAD = 4; // parallel construction and traversal: root cell ranges per pool thread
 
-const size_t increase_primes[MAX_RECURSIVE_LEVEL] {
-        34583,
-        24239,
-        131,
-        1031,
-        6761,
-//        3461,
-//        91243,
-//        29,
-//        7243,
-//        9391,
+// odd 64-bit multipliers, the hash is computed once and every level takes its cell from its own remix
+const uint64_t level_multipliers[MAX_LEVELS] {
+        0xa0761d6478bd642full,
+        0xe7037ed1a0b428dbull,
+        0x8ebc6af09c88c6e3ull,
+        0x589965cc75374cc3ull,
+        0x1d8e4e27c47d124full,
+        0x9e3779b97f4a7c15ull,
+        0xbf58476d1ce4e5b9ull,
+        0x94d049bb133111ebull,
 };
 
-const size_t max_sizes[MAX_SIZE_ID] {
+constexpr size_t max_sizes[MAX_SIZE_ID] {
         13,
         23,
         73,
@@ -44,462 +69,2455 @@ const size_t max_sizes[MAX_SIZE_ID] {
         3365161,
 };
 
-template<typename KeyType, typename ValueType,
-        typename Hash = std::hash<KeyType>>
-class HashMap {
+template<uint8_t Levels, uint8_t SizeIds>
+constexpr std::array<std::array<size_t, SizeIds>, Levels> SameAtEveryLevel(const size_t (&sizes)[SizeIds]) {
+    std::array<std::array<size_t, SizeIds>, Levels> table{};
+    for (size_t level = 0; level < Levels; ++level) {
+        for (size_t id = 0; id < SizeIds; ++id) {
+            table[level][id] = sizes[id];
+        }
+    }
+    return table;
+}
+
+// Compile-time tuning of a HashMap, its Policy parameter is a struct of these constexpr members:
+//   MAX_RECURSIVE_LEVEL                depth of the tree, the leaves of the last level are not bounded
+//   MAX_SIZE_ID, max_sizes[level][id]  cell counts (primes) a node of the level goes through as it grows
+//   MAX_SIZE_DIV_NUMBER_OF_ELEMENTS    an inner node grows when its open cells times this reach its cells
+//   SHRINK_DIV                         and shrinks when its open cells times this drop to its cells
+//   SMALL_SIZE                         elements a leaf holds before it becomes an inner node
+//   SORTED_SEARCH_SIZE                 last level leaves of ordered keys longer than this get a search tree
+//   SEEDED_HASH                        cells come from the hash mixed with a random seed of the map
+//   COMPACT_MAX_CELLS                  inner nodes of at most this many cells store their present children only
+struct DefaultPolicy {
+    static constexpr uint8_t MAX_RECURSIVE_LEVEL = ::MAX_RECURSIVE_LEVEL;
+    static constexpr uint8_t MAX_SIZE_ID = ::MAX_SIZE_ID;
+    static constexpr auto max_sizes = SameAtEveryLevel<MAX_RECURSIVE_LEVEL>(::max_sizes);
+    static constexpr size_t MAX_SIZE_DIV_NUMBER_OF_ELEMENTS = ::MAX_SIZE_DIV_NUMBER_OF_ELEMENTS;
+    static constexpr size_t SHRINK_DIV = MAX_SIZE_DIV_NUMBER_OF_ELEMENTS * MAX_SIZE_DIV_NUMBER_OF_ELEMENTS;
+    static constexpr size_t SMALL_SIZE = 3;
+    static constexpr size_t SORTED_SEARCH_SIZE = 32;
+    static constexpr bool SEEDED_HASH = true;
+    static constexpr size_t COMPACT_MAX_CELLS = 1024;
+};
+
+// the cells depend on the hash alone, the same in every map and every run: for trusted keys only
+struct UnseededPolicy : DefaultPolicy {
+    static constexpr bool SEEDED_HASH = false;
+};
+
+// twice the cells per element of the default: elements spread wider, leaves stay short and shallow,
+// for more memory
+struct LowLatencyPolicy : DefaultPolicy {
+    static constexpr size_t MAX_SIZE_DIV_NUMBER_OF_ELEMENTS = 8;
+    static constexpr size_t SHRINK_DIV = 64;
+    static constexpr size_t SMALL_SIZE = 8;
+};
+
+constexpr size_t low_memory_sizes[MAX_SIZE_ID] {
+        5, 7, 13, 23, 73, 173, 401, 929, 2137, 4931, 11351, 26113, 60103, 138239, 318023, 731531,
+};
+
+// half the cells per element, bigger leaves and small cell counts below the root:
+// fewer and smaller nodes for longer leaf scans
+struct LowMemoryPolicy : DefaultPolicy {
+    static constexpr uint8_t MAX_RECURSIVE_LEVEL = 6;
+    static constexpr auto max_sizes = [] {
+        auto table = SameAtEveryLevel<MAX_RECURSIVE_LEVEL>(low_memory_sizes);
+        table[0] = SameAtEveryLevel<1>(::max_sizes)[0];
+        return table;
+    }();
+    static constexpr size_t MAX_SIZE_DIV_NUMBER_OF_ELEMENTS = 2;
+    static constexpr size_t SHRINK_DIV = 8;
+    static constexpr size_t SMALL_SIZE = 12;
+};
+
+// Lemire's fastmod: for 32-bit values, value % d == ((value * M) mod 2^64 * d) >> 64 with M = 2^64 / d + 1
+template<class Policy>
+constexpr std::array<std::array<uint64_t, Policy::MAX_SIZE_ID>, Policy::MAX_RECURSIVE_LEVEL> MakeMaxSizeMagic() {
+    std::array<std::array<uint64_t, Policy::MAX_SIZE_ID>, Policy::MAX_RECURSIVE_LEVEL> magic{};
+    for (size_t level = 0; level < Policy::MAX_RECURSIVE_LEVEL; ++level) {
+        for (size_t id = 0; id < Policy::MAX_SIZE_ID; ++id) {
+            magic[level][id] = UINT64_MAX / Policy::max_sizes[level][id] + 1;
+        }
+    }
+    return magic;
+}
+
+template<class Policy>
+constexpr auto max_size_magic = MakeMaxSizeMagic<Policy>();
+
+// value % Policy::max_sizes[level][id] without a division
+template<class Policy>
+inline uint32_t ModMaxSize(uint32_t value, uint8_t level, uint8_t id) {
+#ifdef __SIZEOF_INT128__
+    uint64_t low = max_size_magic<Policy>[level][id] * value;
+    return static_cast<uint32_t>((static_cast<unsigned __int128>(low) * Policy::max_sizes[level][id]) >> 64);
+#else
+    return static_cast<uint32_t>(value % Policy::max_sizes[level][id]);
+#endif
+}
+
+// value % max_sizes[id]
+inline uint32_t ModMaxSize(uint32_t value, uint8_t id) {
+    return ModMaxSize<DefaultPolicy>(value, 0, id);
+}
+
+// wyhash's mum: the 128-bit product with both halves folded together
+inline uint64_t Mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#else
+    uint64_t a_high = a >> 32, a_low = static_cast<uint32_t>(a), b_high = b >> 32, b_low = static_cast<uint32_t>(b);
+    uint64_t high = a_high * b_high, middle_1 = a_high * b_low, middle_2 = a_low * b_high, low = a_low * b_low;
+    uint64_t carry = ((low >> 32) + static_cast<uint32_t>(middle_1) + static_cast<uint32_t>(middle_2)) >> 32;
+    uint64_t product_low = low + (middle_1 << 32) + (middle_2 << 32);
+    uint64_t product_high = high + (middle_1 >> 32) + (middle_2 >> 32) + carry;
+    return product_low ^ product_high;
+#endif
+}
+
+// the cell of a hash in a node of the given level and size: the high half of hash * multiplier depends on
+// all bits of the hash. Seeded, the hash goes through a full 128-bit mum with the seed of the map first:
+// keys that collide in one map (even with the identity std::hash<int>) scatter in another, so colliding
+// inputs can not be prepared
+template<class Policy>
+inline uint32_t CellOf(size_t hash, uint64_t seed, uint8_t level, uint8_t size_id) {
+    uint32_t mixed;
+    if constexpr (Policy::SEEDED_HASH) {
+        mixed = static_cast<uint32_t>(Mum(hash ^ seed, level_multipliers[level]) >> 32);
+    } else {
+        mixed = static_cast<uint32_t>((static_cast<uint64_t>(hash) * level_multipliers[level]) >> 32);
+    }
+    return ModMaxSize<Policy>(mixed, level, size_id);
+}
+
+// a different seed for every map: splitmix64 over a per-thread sequence that starts at a random point
+inline uint64_t NewSeed() {
+    static thread_local uint64_t state = (static_cast<uint64_t>(std::random_device()()) << 32) ^
+                                         std::random_device()() ^ reinterpret_cast<uintptr_t>(&state);
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// index of the lowest set bit, bits != 0
+inline size_t CountTrailingZeros(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    size_t count = 0;
+    for (; !(bits & 1); bits >>= 1) {
+        ++count;
+    }
+    return count;
+#endif
+}
+
+inline size_t PopCount(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(bits);
+#else
+    size_t count = 0;
+    for (; bits; bits &= bits - 1) {
+        ++count;
+    }
+    return count;
+#endif
+}
+
+inline void Prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+// Keys whose operator== is a bitwise comparison. Leaves keep such keys (of 4 or 8 bytes)
+// in a separate array as well, which is scanned with SIMD. Specialize for other POD keys.
+template<class KeyType>
+struct is_bitwise_comparable : std::integral_constant<bool, std::is_integral<KeyType>::value ||
+                                                            std::is_enum<KeyType>::value ||
+                                                            std::is_pointer<KeyType>::value> {};
+
+// Hash::is_transparent and KeyEqual::is_transparent enable lookup by any type both accept
+// (std::string_view for std::string keys with std::equal_to<>), without building a KeyType
+template<class Function, class = void>
+struct is_transparent : std::false_type {};
+
+template<class Function>
+struct is_transparent<Function, std::void_t<typename Function::is_transparent>> : std::true_type {};
+
+// a < b compiles
+template<class A, class B, class = void>
+struct is_less_comparable : std::false_type {};
+
+template<class A, class B>
+struct is_less_comparable<A, B, std::void_t<decltype(std::declval<const A&>() < std::declval<const B&>())>>
+        : std::true_type {};
+
+namespace simd {
+    // key and tag arrays are allocated in whole 16-byte chunks, so the last chunk can be loaded entirely
+    const size_t CHUNK = 16;
+
+#ifdef HASH_MAP_X86_SIMD
+    inline bool HasAvx2() {
+        static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return avx2;
+    }
+
+    // bit i of the result is set if lane i (of width bytes) of the chunk equals the key
+    inline uint32_t MatchSse2(const void* chunk, __m128i key, size_t width) {
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128(static_cast<const __m128i*>(chunk)), key);
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(equal)));
+        if (width == 8) {
+            // both halves of a 64-bit lane have to match
+            mask &= mask >> 1;
+            mask = (mask & 1) | ((mask >> 1) & 2);
+        }
+        return mask;
+    }
+
+    // scans whole 32-byte chunks starting from i, stops at the first match
+    __attribute__((target("avx2")))
+    inline bool FindAvx2(const unsigned char* keys, size_t size, size_t width, uint64_t key, size_t& i) {
+        __m256i wide = width == 4 ? _mm256_set1_epi32(static_cast<int>(key)) : _mm256_set1_epi64x(static_cast<long long>(key));
+        size_t lanes = 32 / width;
+        for (; i + lanes <= size; i += lanes) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i * width));
+            __m256i equal = width == 4 ? _mm256_cmpeq_epi32(chunk, wide) : _mm256_cmpeq_epi64(chunk, wide);
+            uint32_t mask = static_cast<uint32_t>(width == 4 ? _mm256_movemask_ps(_mm256_castsi256_ps(equal))
+                                                             : _mm256_movemask_pd(_mm256_castsi256_pd(equal)));
+            if (mask) {
+                i += __builtin_ctz(mask);
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+
+    // index of key in keys[0..size) or size; keys must be readable up to the next CHUNK boundary
+    template<class KeyType>
+    size_t Find(const KeyType* keys, size_t size, const KeyType& key) {
+        static_assert(sizeof(KeyType) == 4 || sizeof(KeyType) == 8, "4 or 8 byte keys only");
+        const size_t width = sizeof(KeyType);
+        const auto* bytes = reinterpret_cast<const unsigned char*>(keys);
+        uint64_t bits = 0;
+        std::memcpy(&bits, &key, width);
+        size_t i = 0;
+#ifdef HASH_MAP_X86_SIMD
+        if (size * width >= 64 && HasAvx2() && FindAvx2(bytes, size, width, bits, i)) {
+            return i;
+        }
+        __m128i narrow = width == 4 ? _mm_set1_epi32(static_cast<int>(bits)) : _mm_set1_epi64x(static_cast<long long>(bits));
+        const size_t lanes = CHUNK / width;
+        for (; i < size; i += lanes) {
+            uint32_t mask = MatchSse2(bytes + i * width, narrow, width);
+            if (mask) {
+                size_t found = i + __builtin_ctz(mask);
+                return found < size ? found : size;
+            }
+        }
+        return size;
+#else
+        for (; i < size; ++i) {
+            if (std::memcmp(bytes + i * width, &key, width) == 0) {
+                return i;
+            }
+        }
+        return size;
+#endif
+    }
+
+    // 8 bits of the hash that are not used by GetPos on the upper levels
+    inline uint8_t Tag(size_t hash) {
+        return static_cast<uint8_t>((static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull) >> 56);
+    }
+
+    // index of the first element with this tag for which equal(index) holds, or size;
+    // tags must be readable up to the next CHUNK boundary
+    template<class Equal>
+    size_t FindTag(const uint8_t* tags, size_t size, uint8_t tag, Equal equal) {
+#ifdef HASH_MAP_X86_SIMD
+        __m128i wide = _mm_set1_epi8(static_cast<char>(tag));
+        for (size_t i = 0; i < size; i += CHUNK) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + i));
+            uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, wide)));
+            if (size - i < CHUNK) {
+                mask &= (1u << (size - i)) - 1;
+            }
+            for (; mask; mask &= mask - 1) {
+                size_t index = i + __builtin_ctz(mask);
+                if (equal(index)) {
+                    return index;
+                }
+            }
+        }
+        return size;
+#else
+        for (size_t i = 0; i < size; ++i) {
+            if (tags[i] == tag && equal(i)) {
+                return i;
+            }
+        }
+        return size;
+#endif
+    }
+
+    // capacity (in entries) covering whole chunks
+    template<class Entry>
+    size_t PaddedCapacity(size_t size) {
+        const size_t lanes = CHUNK / sizeof(Entry);
+        return (size + lanes - 1) / lanes * lanes;
+    }
+}
+
+// Slab allocator shared by all nodes of one map. Nodes and small blocks (small_data, small data
+// arrays) are carved from big slabs and recycled through free lists of 16-byte size classes,
+// bigger blocks are allocated one by one but tracked, so the whole map can be dropped at once.
+// Over-aligned values widen the granule to their alignment, every block starts on a granule.
+// All memory, the arena itself included, comes from the map's Allocator.
+template<class Allocator>
+class NodeArena {
+    static constexpr size_t ALIGNMENT = std::max<size_t>(16, alignof(typename Allocator::value_type));
+    struct alignas(ALIGNMENT) Granule {
+        unsigned char bytes[ALIGNMENT];
+    };
+    using Upstream = typename std::allocator_traits<Allocator>::template rebind_alloc<Granule>;
+    using UpstreamTraits = std::allocator_traits<Upstream>;
+    using Self = typename std::allocator_traits<Allocator>::template rebind_alloc<NodeArena>;
+
 public:
-    explicit HashMap(const Hash& hash, uint8_t level, size_t from, HashMap* par) :
-            hasher(hash), recursive_level(level), id_max_size(0),
-            number_of_elements(0), stupid(true), from_index(from), parent(par), open_cells(0),
-            increase(increase_primes[recursive_level]), max_size(max_sizes[id_max_size]) {}
+    static const size_t GRANULE = sizeof(Granule);
+    static const size_t SIZE_CLASSES = 32; // blocks up to 32 granules (512 bytes) come from slabs
+    // slabs double from the first to the last size, so a map of a few elements holds a few hundred bytes
+    static const size_t MIN_SLAB_SIZE = 256;
+    static const size_t MAX_SLAB_SIZE = 1 << 16;
+    // large granules (over-aligned values) leave fewer blocks to the slabs, at least 8 fit in the largest one
+    static const size_t SLAB_CLASSES = std::min(SIZE_CLASSES, MAX_SLAB_SIZE / GRANULE / 8);
+
+    static NodeArena* Create(const Allocator& allocator) {
+        Self self(allocator);
+        NodeArena* arena = std::allocator_traits<Self>::allocate(self, 1);
+        return new (arena) NodeArena(allocator);
+    }
 
-    explicit HashMap(const Hash& hash = Hash()) : HashMap(hash, 0, 0, NULL) {}
+    static void Destroy(NodeArena* arena) noexcept {
+        Self self(arena->upstream);
+        arena->~NodeArena();
+        std::allocator_traits<Self>::deallocate(self, arena, 1);
+    }
 
-    template<class Iterator>
-    HashMap(Iterator it_begin, Iterator it_end,
-            const Hash& hash = Hash()) : HashMap(hash) {
-        for (Iterator it = it_begin; it != it_end; ++it) {
-            insert(*it);
+    struct Deleter {
+        void operator()(NodeArena* arena) const noexcept {
+            Destroy(arena);
         }
+    };
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    Allocator get_allocator() const {
+        return Allocator(upstream);
     }
 
-    HashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
-            const Hash& hash = Hash()) : HashMap(hash) {
-        for (const std::pair<KeyType, ValueType>& element : list) {
-            insert(element);
+    void* allocate(size_t bytes) {
+        size_t size_class = std::max<size_t>(1, (bytes + GRANULE - 1) / GRANULE);
+        if (size_class > SLAB_CLASSES) {
+            size_t granules = size_class + sizeof(LargeBlock) / GRANULE;
+            auto* block = reinterpret_cast<LargeBlock*>(UpstreamTraits::allocate(upstream, granules));
+            block->granules = granules;
+            block->prev = nullptr;
+            block->next = large;
+            if (large) {
+                large->prev = block;
+            }
+            large = block;
+            return block + 1;
+        }
+        if (FreeBlock* block = free_lists[size_class]) {
+            free_lists[size_class] = block->next;
+            return block;
+        }
+        size_t size = size_class * GRANULE;
+        if (slab_left < size) {
+            NewSlab(size);
         }
+        void* result = slab_top;
+        slab_top += size;
+        slab_left -= size;
+        return result;
     }
 
-    HashMap(const HashMap& other) : HashMap(other.hasher) {
-        *this = other;
+    void deallocate(void* pointer, size_t bytes) noexcept {
+        size_t size_class = std::max<size_t>(1, (bytes + GRANULE - 1) / GRANULE);
+        if (size_class > SLAB_CLASSES) {
+            auto* block = static_cast<LargeBlock*>(pointer) - 1;
+            (block->prev ? block->prev->next : large) = block->next;
+            if (block->next) {
+                block->next->prev = block->prev;
+            }
+            UpstreamTraits::deallocate(upstream, reinterpret_cast<Granule*>(block), block->granules);
+            return;
+        }
+        auto* block = static_cast<FreeBlock*>(pointer);
+        block->next = free_lists[size_class];
+        free_lists[size_class] = block;
     }
 
+    // elements are constructed through the user's allocator, so pmr containers inside get its resource
+    template<class T, class... Args>
+    void construct(T* pointer, Args&&... args) {
+        using Rebound = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        Rebound allocator(upstream);
+        std::allocator_traits<Rebound>::construct(allocator, pointer, std::forward<Args>(args)...);
+    }
 
+    template<class T>
+    void destroy(T* pointer) {
+        using Rebound = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        Rebound allocator(upstream);
+        std::allocator_traits<Rebound>::destroy(allocator, pointer);
+    }
 
-    struct iterator {
-        using ItValueType = std::pair<const KeyType, ValueType>;
-        explicit iterator() = default;
+    // an arena that another thread filled becomes part of this one, it is released and destroyed with it
+    void adopt(NodeArena* other) noexcept {
+        other->next_adopted = adopted;
+        adopted = other;
+    }
+
+    // frees everything at once, blocks handed out before are gone without being deallocated
+    void release() noexcept {
+        while (adopted) {
+            NodeArena* next = adopted->next_adopted;
+            Destroy(adopted);
+            adopted = next;
+        }
+        while (slabs) {
+            Slab* next = slabs->next;
+            UpstreamTraits::deallocate(upstream, reinterpret_cast<Granule*>(slabs), slabs->granules);
+            slabs = next;
+        }
+        while (large) {
+            LargeBlock* next = large->next;
+            UpstreamTraits::deallocate(upstream, reinterpret_cast<Granule*>(large), large->granules);
+            large = next;
+        }
+        std::fill(std::begin(free_lists), std::end(free_lists), nullptr);
+        slab_top = nullptr;
+        slab_left = 0;
+        slab_granules = FIRST_SLAB_GRANULES;
+    }
 
-        explicit iterator(ItValueType* _value, HashMap* _from, uint8_t id, uint8_t rec_level = 0) : value(_value), from(_from), index(id), local_recursive_level(rec_level) {}
+private:
+    static const size_t FIRST_SLAB_GRANULES = std::max<size_t>(1, MIN_SLAB_SIZE / GRANULE);
 
-        iterator(const iterator& other) : iterator(other.value, other.from, other.index, other.local_recursive_level) {}
-        iterator(const iterator& other, uint8_t rec_level) : iterator(other.value, other.from, other.index, rec_level) {}
+    explicit NodeArena(const Allocator& allocator) : upstream(allocator) {}
 
+    ~NodeArena() {
+        release();
+    }
 
-        bool operator==(const iterator &other) {
-            return value == other.value && local_recursive_level == other.local_recursive_level;
+    // a slab for at least size bytes, what is left of the current one goes to the free list of its size
+    void NewSlab(size_t size) {
+        if (slab_left >= GRANULE) {
+            deallocate(slab_top, slab_left);
         }
-        bool operator!=(const iterator &other) {
-            return !(*this == other);
+        size_t granules = std::max(slab_granules, (sizeof(Slab) + size) / GRANULE);
+        auto* slab = reinterpret_cast<Slab*>(UpstreamTraits::allocate(upstream, granules));
+        slab->next = slabs;
+        slab->granules = granules;
+        slabs = slab;
+        slab_top = reinterpret_cast<char*>(slab) + sizeof(Slab);
+        slab_left = granules * GRANULE - sizeof(Slab);
+        slab_granules = std::min(2 * slab_granules, std::max<size_t>(1, MAX_SLAB_SIZE / GRANULE));
+    }
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    struct alignas(GRANULE) Slab {
+        Slab* next;
+        size_t granules;
+    };
+    struct alignas(GRANULE) LargeBlock {
+        LargeBlock* prev;
+        LargeBlock* next;
+        size_t granules;
+    };
+
+    Upstream upstream;
+    FreeBlock* free_lists[SIZE_CLASSES + 1]{};
+    Slab* slabs = nullptr;
+    LargeBlock* large = nullptr;
+    char* slab_top = nullptr;
+    size_t slab_left = 0;
+    size_t slab_granules = FIRST_SLAB_GRANULES; // of the next slab
+    NodeArena* adopted = nullptr;
+    NodeArena* next_adopted = nullptr;
+};
+
+// std allocator interface over the NodeArena of a map
+template<class T, class Arena>
+struct ArenaAllocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template<class U>
+    struct rebind {
+        using other = ArenaAllocator<U, Arena>;
+    };
+
+    explicit ArenaAllocator(Arena* arena) noexcept : arena(arena) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U, Arena>& other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= Arena::GRANULE, "arena blocks are only granule aligned");
+        return static_cast<T*>(arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, size_t n) noexcept {
+        arena->deallocate(pointer, n * sizeof(T));
+    }
+
+    template<class U, class... Args>
+    void construct(U* pointer, Args&&... args) {
+        arena->construct(pointer, std::forward<Args>(args)...);
+    }
+
+    template<class U>
+    void destroy(U* pointer) {
+        arena->destroy(pointer);
+    }
+
+    template<class U>
+    bool operator==(const ArenaAllocator<U, Arena>& other) const {
+        return arena == other.arena;
+    }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U, Arena>& other) const {
+        return arena != other.arena;
+    }
+
+    Arena* arena;
+};
+
+template<typename KeyType, typename ValueType,
+        typename Hash = std::hash<KeyType>,
+        typename KeyEqual = std::equal_to<KeyType>,
+        typename Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+        typename Policy = DefaultPolicy>
+class HashMap {
+    static_assert(Policy::MAX_RECURSIVE_LEVEL > 0 && Policy::MAX_RECURSIVE_LEVEL <= MAX_LEVELS, "policy too deep");
+    static_assert(Policy::SMALL_SIZE > 0, "leaves must hold an element");
+
+    struct Node;
+    struct Order;
+    struct Root;
+    using Arena = NodeArena<Allocator>;
+    using SmallVector = std::vector<std::pair<const KeyType, ValueType>, ArenaAllocator<std::pair<const KeyType, ValueType>, Arena>>;
+    using NodeVector = std::vector<Node*, ArenaAllocator<Node*, Arena>>;
+    using BitVector = std::vector<uint64_t, ArenaAllocator<uint64_t, Arena>>;
+
+    // last level leaves are not bounded in size, they keep a contiguous copy of such keys
+    // for SIMD scans (values stay in the pairs, iterators hand out std::pair<const KeyType, ValueType>&)
+    static const bool SIMD_KEYS = is_bitwise_comparable<KeyType>::value &&
+                                  (sizeof(KeyType) == 4 || sizeof(KeyType) == 8) &&
+                                  (std::is_same<KeyEqual, std::equal_to<KeyType>>::value ||
+                                   std::is_same<KeyEqual, std::equal_to<>>::value);
+    template<class K>
+    using EnableTransparent = std::enable_if_t<is_transparent<Hash>::value && is_transparent<KeyEqual>::value &&
+                                               !std::is_convertible<const K&, size_t>::value>;
+    // last level leaves collect the keys whose hashes collide all the way down and are not bounded in size:
+    // past SORTED_SEARCH_SIZE, a leaf of ordered keys keeps a search tree of its elements (see Order), so that
+    // a flood of colliding keys costs O(log n) comparisons per operation. Equal keys have to be equivalent
+    // for operator<, so only plain equality qualifies; operator< may be coarser, key_equal has the last word
+    static const bool SORTED_KEYS = is_less_comparable<KeyType, KeyType>::value &&
+                                    (std::is_same<KeyEqual, std::equal_to<KeyType>>::value ||
+                                     std::is_same<KeyEqual, std::equal_to<>>::value);
+    // leaves with other keys keep an 8-bit hash tag per element and compare keys on tag hits only
+    using IndexEntry = std::conditional_t<SIMD_KEYS, KeyType, uint8_t>;
+    using IndexVector = std::vector<IndexEntry, ArenaAllocator<IndexEntry, Arena>>;
+    using AllocatorTraits = std::allocator_traits<Allocator>;
+
+    // nothing outside of the arena is owned by the nodes, so the tree does not have to be walked on teardown
+    static const bool TRIVIAL_TEARDOWN = std::is_trivially_destructible<KeyType>::value &&
+                                         std::is_trivially_destructible<ValueType>::value;
+
+    // A node of the tree: a leaf (stupid) with its elements in small_data, or an inner node whose cells hold
+    // the nodes of the next level. What all nodes share (hasher, key_equal, seed, allocator) is kept once
+    // by the map and the cell count follows from the level and the size id, so a node is its vectors
+    // and a few packed counters. A leaf has no cells and an inner node no elements, the two pairs of
+    // vectors share their place and stupid tells which one is alive
+    struct Node {
+        Node(uint8_t level, size_t from, Node* par, Arena* arena) :
+                parent(par), number_of_elements(0), order(nullptr), from_index(static_cast<uint32_t>(from)),
+                recursive_level(level), id_max_size(0), stupid(true),
+                small_data(ArenaAllocator<char, Arena>(arena)), small_index(ArenaAllocator<char, Arena>(arena)) {}
+
+        // other keeps its kind with moved-from vectors
+        Node(Node&& other) noexcept :
+                parent(other.parent), number_of_elements(other.number_of_elements), from_index(other.from_index),
+                recursive_level(other.recursive_level), id_max_size(other.id_max_size), stupid(other.stupid) {
+            MoveVectorsFrom(other);
         }
 
+        Node& operator=(const Node&) = delete;
 
-        ItValueType& operator*() const {
-            return *value;
+        ~Node() {
+            DestroyVectors();
         }
-        ItValueType* operator->() const {
-            return value;
+
+        // the node becomes the kind of other and takes its vectors (and open_cells or order),
+        // its own elements are destroyed
+        void TakeVectors(Node& other) noexcept {
+            DestroyVectors();
+            stupid = other.stupid;
+            MoveVectorsFrom(other);
         }
 
-        iterator& operator=(const iterator& other) {
-            if (&other == this) {
-                return *this;
+        // an empty leaf becomes an inner node without cells
+        void BecomeInner() noexcept {
+            ArenaAllocator<char, Arena> storage(Storage());
+            DestroyVectors();
+            new (&data) NodeVector(storage);
+            new (&occupied) BitVector(storage);
+            stupid = false;
+            open_cells = 0;
+        }
+
+        // an inner node whose children are gone becomes an empty leaf
+        void BecomeLeaf() noexcept {
+            ArenaAllocator<char, Arena> storage(Storage());
+            DestroyVectors();
+            new (&small_data) SmallVector(storage);
+            new (&small_index) IndexVector(storage);
+            stupid = true;
+            order = nullptr;
+        }
+
+        bool empty() const {
+            return number_of_elements == 0;
+        }
+
+        size_t size() const {
+            return number_of_elements;
+        }
+
+        bool LastLevel() const {
+            return recursive_level + 1 == Policy::MAX_RECURSIVE_LEVEL;
+        }
+
+        // cell counts of the level of this node
+        const std::array<size_t, Policy::MAX_SIZE_ID>& Sizes() const {
+            return Policy::max_sizes[recursive_level];
+        }
+
+        // prime, num of cells for elements
+        size_t MaxSize() const {
+            return Sizes()[id_max_size];
+        }
+
+        // the smallest inner size whose cells hold count elements without growing
+        uint8_t SizeIdFor(size_t count) const {
+            uint8_t size_id = 1;
+            while (size_id + 1 < Policy::MAX_SIZE_ID &&
+                   Sizes()[size_id] <= count * Policy::MAX_SIZE_DIV_NUMBER_OF_ELEMENTS) {
+                ++size_id;
             }
-            value = other.value;
-            from = other.from;
-            index = other.index;
-            local_recursive_level = other.local_recursive_level;
-            return *this;
+            return size_id;
         }
 
-        iterator end() {
-            return iterator();
+        // the arena of the vectors of the node and of its children
+        Arena* Storage() const {
+            return stupid ? small_data.get_allocator().arena : data.get_allocator().arena;
         }
 
-        iterator& operator++() {
-            if (*this == end()) {
-                return *this;
+        // small_index is kept for every leaf with tags and for last level leaves with SIMD keys
+        bool Indexed() const {
+            return !SIMD_KEYS || LastLevel();
+        }
+
+        // std::vector would copy the const keys on reallocation, so small_data grows by hand.
+        // Returns the index of the new element, the last one
+        template<class... Args>
+        size_t EmplaceSmall(size_t hash, Args&&... args) {
+            if (small_data.size() == small_data.capacity()) {
+                SmallVector grown(small_data.get_allocator());
+                grown.reserve(std::max<size_t>(1, 2 * small_data.capacity()));
+                for (auto& element : small_data) {
+                    grown.emplace_back(MovableKey(element), std::move(element.second));
+                }
+                small_data.swap(grown);
+                if (Indexed()) {
+                    small_index.reserve(simd::PaddedCapacity<IndexEntry>(small_data.capacity()));
+                }
             }
-            HashMap* map = from;
-            if (!map->stupid) {
-                *this = end();
-                return *this;
+            small_data.emplace_back(std::forward<Args>(args)...);
+            if (Indexed()) {
+                small_index.push_back(IndexOf(small_data.back().first, hash));
+            }
+            const size_t index = small_data.size() - 1;
+            if constexpr (SORTED_KEYS) {
+                // without its tree the leaf is scanned as a short one, so a failed allocation only drops it
+                try {
+                    if (order) {
+                        order->positions.insert(static_cast<uint32_t>(index));
+                    } else if (LastLevel() && small_data.size() > Policy::SORTED_SEARCH_SIZE) {
+                        BuildOrder();
+                    }
+                } catch (...) {
+                    DropOrder();
+                }
+            }
+            return index;
+        }
+
+        // the last element takes the place of the erased one
+        void EraseSmall(size_t index) {
+            if constexpr (SORTED_KEYS) {
+                if (order && small_data.size() <= Policy::SORTED_SEARCH_SIZE / 2) {
+                    DropOrder();
+                } else if (order) {
+                    order->positions.erase(static_cast<uint32_t>(index));
+                }
+            }
+            if (index + 1 != small_data.size()) {
+                auto& last = small_data.back();
+                if constexpr (std::is_nothrow_move_constructible<KeyType>::value &&
+                              std::is_nothrow_move_constructible<ValueType>::value) {
+                    // the position of the last element is taken out of the tree while its key is still there
+                    typename Order::Positions::node_type moved;
+                    if constexpr (SORTED_KEYS) {
+                        if (order) {
+                            moved = order->positions.extract(static_cast<uint32_t>(small_data.size() - 1));
+                        }
+                    }
+                    Arena* arena = Storage();
+                    auto* place = &small_data[index];
+                    arena->destroy(place);
+                    arena->construct(place, MovableKey(last), std::move(last.second));
+                    if constexpr (SORTED_KEYS) {
+                        if (moved) {
+                            moved.value() = static_cast<uint32_t>(index);
+                            order->positions.insert(std::move(moved));
+                        }
+                    }
+                } else {
+                    // the positions after index shift, the next insert builds the tree again
+                    DropOrder();
+                    SmallVector rest(small_data.get_allocator());
+                    rest.reserve(small_data.capacity());
+                    for (size_t i = 0; i < small_data.size(); ++i) if (i != index) {
+                        rest.emplace_back(MovableKey(small_data[i]), std::move(small_data[i].second));
+                    }
+                    small_data.swap(rest);
+                    if (Indexed()) {
+                        small_index.erase(small_index.begin() + index);
+                    }
+                    return;
+                }
+            }
+            small_data.pop_back();
+            if (Indexed()) {
+                small_index[index] = small_index.back();
+                small_index.pop_back();
+            }
+        }
+
+        // Small inner nodes are compact: data holds the present children only, in the order of their cells,
+        // and the child of a cell is found by the number of occupied cells before it. Larger nodes
+        // (the root of a big map) keep a pointer per cell, so that a new child is not shifted into place.
+        // old_data is always a pointer per cell
+        bool Compact() const {
+            return MaxSize() <= Policy::COMPACT_MAX_CELLS;
+        }
+
+        Node* Child(size_t pos) const {
+            if (!Compact()) {
+                return data[pos];
+            }
+            return (occupied[pos / 64] >> (pos % 64) & 1) ? data[Rank(pos)] : nullptr;
+        }
+
+        // occupied cells before pos
+        size_t Rank(size_t pos) const {
+            size_t rank = PopCount(occupied[pos / 64] & ((uint64_t(1) << (pos % 64)) - 1));
+            for (size_t word = 0; word < pos / 64; ++word) {
+                rank += PopCount(occupied[word]);
+            }
+            return rank;
+        }
+
+        void PrefetchCell(size_t pos) const {
+            if (Compact()) {
+                Prefetch(occupied.data());
+                Prefetch(data.data());
+            } else {
+                Prefetch(&data[pos]);
+            }
+        }
+
+        // cells of data are only written through here, to keep occupied in step
+        void SetCell(size_t pos, Node* child) {
+            uint64_t& word = occupied[pos / 64];
+            const uint64_t bit = uint64_t(1) << (pos % 64);
+            if (!Compact()) {
+                data[pos] = child;
+            } else if (word & bit) {
+                if (child) {
+                    data[Rank(pos)] = child;
+                } else {
+                    data.erase(data.begin() + Rank(pos));
+                }
+            } else if (child) {
+                data.insert(data.begin() + Rank(pos), child);
+            }
+            word = child ? word | bit : word & ~bit;
+        }
+
+        // MaxSize() empty cells
+        void ResetCells() {
+            data = NodeVector(Compact() ? 0 : MaxSize(), nullptr, data.get_allocator());
+            occupied = BitVector((MaxSize() + 63) / 64, 0, occupied.get_allocator());
+        }
+
+        // cells of the node as seen by iteration: data, then for the root the not yet migrated part of old_data
+        size_t CellCount() const {
+            return MaxSize() + (parent ? 0 : static_cast<const Root&>(*this).old_data.size());
+        }
+
+        Node* Cell(size_t id) const {
+            return id < MaxSize() ? Child(id) : static_cast<const Root&>(*this).old_data[id - MaxSize()];
+        }
+
+        // the first cell from id on that holds a child, CellCount() if there is none.
+        // Whole words of empty cells are skipped, so iterating sparse nodes does not touch their cells
+        size_t NextCell(size_t id) const {
+            const size_t cells = MaxSize();
+            if (id < cells) {
+                id = NextBit(occupied, id, cells);
+                if (id < cells) {
+                    return id;
+                }
+            }
+            if (parent) {
+                return cells;
+            }
+            const Root& root = static_cast<const Root&>(*this);
+            return cells + NextBit(root.old_occupied, id - cells, root.old_data.size());
+        }
+
+        size_t CellIndex(const Node* child) const {
+            if (child->from_index < MaxSize() && Child(child->from_index) == child) {
+                return child->from_index;
+            }
+            return MaxSize() + child->from_index;
+        }
+
+        Node* parent; // the root is the only node without one
+        size_t number_of_elements;
+        union {
+            uint32_t open_cells; // inner node
+            Order* order; // leaf, only long last level leaves of ordered keys have one
+        };
+        uint32_t from_index; // cell of the parent
+        uint8_t recursive_level;
+        uint8_t id_max_size;
+        bool stupid;
+        union {
+            SmallVector small_data; // leaf
+            NodeVector data; // inner node, see Compact()
+        };
+        union {
+            IndexVector small_index; // leaf, see Indexed(): keys or tags of small_data, in the same order
+            BitVector occupied; // inner node, a bit per cell of data, set if the cell has a child
+        };
+
+        // a tree of the positions of all elements, for a long last level leaf
+        void BuildOrder() {
+            void* memory = Storage()->allocate(sizeof(Order));
+            order = new (memory) Order(this);
+            for (size_t i = 0; i < small_data.size(); ++i) {
+                order->positions.insert(static_cast<uint32_t>(i));
+            }
+        }
+
+        void DropOrder() noexcept {
+            if (order) {
+                Arena* arena = Storage();
+                order->~Order();
+                arena->deallocate(order, sizeof(Order));
+                order = nullptr;
+            }
+        }
+
+    private:
+        void MoveVectorsFrom(Node& other) noexcept {
+            if (stupid) {
+                new (&small_data) SmallVector(std::move(other.small_data));
+                new (&small_index) IndexVector(std::move(other.small_index));
+                order = other.order;
+                other.order = nullptr;
+                if (order) {
+                    order->node = this;
+                }
+            } else {
+                new (&data) NodeVector(std::move(other.data));
+                new (&occupied) BitVector(std::move(other.occupied));
+                open_cells = other.open_cells;
+            }
+        }
+
+        void DestroyVectors() noexcept {
+            if (stupid) {
+                DropOrder();
+                small_data.~SmallVector();
+                small_index.~IndexVector();
+            } else {
+                data.~NodeVector();
+                occupied.~BitVector();
+            }
+        }
+    };
+
+    // the positions of the elements of a leaf in key order, equal keys by position. Lookups take the range
+    // of keys equivalent to theirs for operator<, an erased element leaves the tree and the last one
+    // is re-inserted at its new position
+    template<class K>
+    struct OrderProbe {
+        const K& key;
+    };
+
+    struct Order {
+        struct Less {
+            using is_transparent = void;
+
+            bool operator()(uint32_t a, uint32_t b) const {
+                const KeyType& first = order->Key(a);
+                const KeyType& second = order->Key(b);
+                return first < second || (!(second < first) && a < b);
+            }
+
+            template<class K>
+            bool operator()(uint32_t position, const OrderProbe<K>& probe) const {
+                return order->Key(position) < probe.key;
+            }
+
+            template<class K>
+            bool operator()(const OrderProbe<K>& probe, uint32_t position) const {
+                return probe.key < order->Key(position);
+            }
+
+            const Order* order;
+        };
+        using Positions = std::set<uint32_t, Less, ArenaAllocator<uint32_t, Arena>>;
+
+        explicit Order(const Node* leaf) :
+                node(leaf), positions(Less{this}, ArenaAllocator<uint32_t, Arena>(leaf->Storage())) {}
+
+        const KeyType& Key(uint32_t position) const {
+            return node->small_data[position].first;
+        }
+
+        const Node* node; // follows the node when it moves
+        Positions positions;
+    };
+
+    // only the root resizes incrementally, it keeps its cells of the previous size until they are migrated
+    struct Root : Node {
+        explicit Root(Arena* arena) :
+                Node(0, 0, nullptr, arena),
+                old_data(ArenaAllocator<char, Arena>(arena)), old_occupied(ArenaAllocator<char, Arena>(arena)) {}
+
+        NodeVector old_data; // root cells not migrated yet
+        BitVector old_occupied; // the same for old_data
+    };
+
+public:
+    using allocator_type = Allocator;
+
+    explicit HashMap(const Hash& hash = Hash(), const KeyEqual& equal = KeyEqual(), const Allocator& alloc = Allocator()) :
+            hasher(hash), key_equal(equal), old_id_max_size(0), reserved_id_max_size(0), next_id_max_size(0),
+            seed(Policy::SEEDED_HASH ? NewSeed() : 0), incremental(false), migrated(0), next_cells(nullptr), allocator(alloc),
+            own_arena(Arena::Create(alloc)), root(own_arena.get()) {}
+
+    HashMap(const Hash& hash, const Allocator& alloc) : HashMap(hash, KeyEqual(), alloc) {}
+
+    explicit HashMap(const Allocator& alloc) : HashMap(Hash(), KeyEqual(), alloc) {}
+
+    template<class Iterator>
+    HashMap(Iterator it_begin, Iterator it_end, const Hash& hash = Hash(), const KeyEqual& equal = KeyEqual(),
+            const Allocator& alloc = Allocator()) : HashMap(hash, equal, alloc) {
+        for (Iterator it = it_begin; it != it_end; ++it) {
+            emplace(*it);
+        }
+    }
+
+    // builds the tree on the pool: the root gets its final size up front, the input is split into ranges of
+    // root cells and every range is built by one task, without locks, into an arena of its own.
+    // Iterator must be random access over pairs, and hash must be callable from several threads
+    template<class Iterator>
+    HashMap(Iterator it_begin, Iterator it_end, ThreadPool& pool, const Hash& hash = Hash(),
+            const KeyEqual& equal = KeyEqual(), const Allocator& alloc = Allocator()) : HashMap(hash, equal, alloc) {
+        BuildParallel(it_begin, it_end, pool);
+    }
+
+    HashMap(std::initializer_list<std::pair<KeyType, ValueType>> list, const Hash& hash = Hash(),
+            const KeyEqual& equal = KeyEqual(), const Allocator& alloc = Allocator()) : HashMap(hash, equal, alloc) {
+        for (const std::pair<KeyType, ValueType>& element : list) {
+            insert(element);
+        }
+    }
+
+    HashMap(const HashMap& other) :
+            HashMap(other.hasher, other.key_equal, AllocatorTraits::select_on_container_copy_construction(other.allocator)) {
+        *this = other;
+    }
+
+    HashMap(const HashMap& other, const Allocator& alloc) : HashMap(other.hasher, other.key_equal, alloc) {
+        *this = other;
+    }
+
+    // steals the whole tree, only the direct children have to be re-parented
+    HashMap(HashMap&& other) noexcept(std::is_nothrow_move_constructible<Hash>::value &&
+                                      std::is_nothrow_move_constructible<KeyEqual>::value) :
+            hasher(std::move(other.hasher)), key_equal(std::move(other.key_equal)),
+            old_id_max_size(other.old_id_max_size), reserved_id_max_size(other.reserved_id_max_size),
+            next_id_max_size(other.next_id_max_size), seed(other.seed), incremental(other.incremental),
+            migrated(other.migrated), next_cells(other.next_cells), allocator(other.allocator),
+            own_arena(std::move(other.own_arena)), root(std::move(other.root)) {
+        other.next_cells = nullptr;
+        AdoptChildren();
+        other.DropArena();
+        other.clear();
+    }
+
+
+
+    struct iterator {
+        using ItValueType = std::pair<const KeyType, ValueType>;
+        explicit iterator() = default;
+
+        explicit iterator(ItValueType* _value, Node* _from, size_t id) : value(_value), from(_from), index(id) {}
+
+        iterator(const iterator& other) : iterator(other.value, other.from, other.index) {}
+
+
+        bool operator==(const iterator &other) const {
+            return value == other.value;
+        }
+        bool operator!=(const iterator &other) const {
+            return !(*this == other);
+        }
+
+
+        ItValueType& operator*() const {
+            return *value;
+        }
+        ItValueType* operator->() const {
+            return value;
+        }
+
+        iterator& operator=(const iterator& other) {
+            if (&other == this) {
+                return *this;
+            }
+            value = other.value;
+            from = other.from;
+            index = other.index;
+            return *this;
+        }
+
+        iterator end() {
+            return iterator();
+        }
+
+        iterator& operator++() {
+            if (*this == end()) {
+                return *this;
+            }
+            Node* node = from;
+            if (!node->stupid) {
+                *this = end();
+                return *this;
+            }
+            if (index + 1 < node->size()) {
+                *this = iterator(&(node->small_data[index+1]), from, index + 1);
+                return *this;
+            }
+
+            size_t id;
+            while(node->parent) {
+                Node* child = node;
+                node = node->parent;
+                for (id = node->NextCell(node->CellIndex(child) + 1); id < node->CellCount(); id = node->NextCell(id + 1)) {
+                    Node* cell = node->Cell(id);
+                    if (!cell->empty()) {
+                        *this = First<iterator>(cell);
+                        return *this;
+                    }
+                }
+            }
+            *this = end();
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator result = *this;
+            ++(*this);
+            return result;
+        }
+    private:
+        ItValueType* value;
+        Node* from;
+        size_t index{}; // in small_data of from, last level leaves are not bounded
+    };
+
+    struct const_iterator {
+        using ItValueType = const std::pair<const KeyType, ValueType>;
+        explicit const_iterator() = default;
+
+        explicit const_iterator(ItValueType* _value, const Node* _from, size_t id) : value(_value), from(_from), index(id) {}
+
+        const_iterator(const const_iterator& other) : const_iterator(other.value, other.from, other.index) {}
+
+        bool operator==(const const_iterator &other) const {
+            return value == other.value;
+        }
+        bool operator!=(const const_iterator &other) const {
+            return !(*this == other);
+        }
+
+
+        ItValueType& operator*() const {
+            return *value;
+        }
+        ItValueType* operator->() const {
+            return value;
+        }
+
+        const_iterator& operator=(const const_iterator& other) {
+            if (&other == this) {
+                return *this;
+            }
+            value = other.value;
+            from = other.from;
+            index = other.index;
+            return *this;
+        }
+
+        const_iterator end() {
+            return const_iterator();
+        }
+
+        const_iterator& operator++() {
+            if (*this == end()) {
+                return *this;
+            }
+            const Node* node = from;
+            if (!node->stupid) {
+                *this = end();
+                return *this;
+            }
+            if (index + 1 < node->size()) {
+                *this = const_iterator(&(node->small_data[index+1]), from, index + 1);
+                return *this;
+            }
+
+            size_t id;
+            while(node->parent) {
+                const Node* child = node;
+                node = node->parent;
+                for (id = node->NextCell(node->CellIndex(child) + 1); id < node->CellCount(); id = node->NextCell(id + 1)) {
+                    const Node* cell = node->Cell(id);
+                    if (!cell->empty()) {
+                        *this = First<const_iterator>(cell);
+                        return *this;
+                    }
+                }
+            }
+            *this = end();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator result = *this;
+            ++(*this);
+            return result;
+        }
+    private:
+        ItValueType* value;
+        const Node* from;
+        size_t index{}; // in small_data of from, last level leaves are not bounded
+    };
+
+    iterator begin() {
+        if (root.empty()) {
+            return end();
+        }
+        return First<iterator>(static_cast<Node*>(&root));
+    }
+    const_iterator begin() const {
+        if (root.empty()) {
+            return end();
+        }
+        return First<const_iterator>(static_cast<const Node*>(&root));
+    }
+
+    iterator end() {
+        return iterator();
+    }
+    const_iterator end() const {
+        return const_iterator();
+    }
+
+    // f(std::pair<const KeyType, ValueType>&) for every element, in no particular order: the pool threads take
+    // ranges of root cells one at a time and walk their subtrees. f runs on several threads at once, the map
+    // must not change meanwhile
+    template<class F>
+    void for_each_parallel(F f, ThreadPool& pool) {
+        ForEachRootRange(*this, pool, [&](size_t, auto walk) {
+            walk(f);
+        });
+    }
+
+    template<class F>
+    void for_each_parallel(F f, ThreadPool& pool) const {
+        ForEachRootRange(*this, pool, [&](size_t, auto walk) {
+            walk(f);
+        });
+    }
+
+    // reduce(init, transform(element), ...) in an unspecified order and grouping, as std::transform_reduce:
+    // every range of root cells is reduced on its own thread and the results are combined at the end
+    template<class T, class Reduce, class Transform>
+    T transform_reduce(T init, Reduce reduce, Transform transform, ThreadPool& pool) const {
+        std::vector<std::optional<T>> partial(pool.size() * PARALLEL_TASKS_PER_THREAD);
+        ForEachRootRange(*this, pool, [&](size_t range, auto walk) {
+            std::optional<T> local;
+            walk([&](const std::pair<const KeyType, ValueType>& element) {
+                if (local) {
+                    local = reduce(std::move(*local), transform(element));
+                } else {
+                    local.emplace(transform(element));
+                }
+            });
+            partial[range] = std::move(local);
+        });
+        for (auto& result : partial) {
+            if (result) {
+                init = reduce(std::move(init), std::move(*result));
+            }
+        }
+        return init;
+    }
+
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+    // the hash that the overloads taking a precomputed hash expect, same as hash_function()(key)
+    size_t hash_of(const KeyType& key) const {
+        return hasher(key);
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    size_t hash_of(const K& key) const {
+        return hasher(key);
+    }
+
+    Allocator get_allocator() const {
+        return allocator;
+    }
+
+    iterator find(const KeyType& key) {
+        return Find(root, key, hasher(key));
+    }
+
+    const_iterator find(const KeyType& key) const {
+        return Find(root, key, hasher(key));
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    iterator find(const K& key) {
+        return Find(root, key, hasher(key));
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    const_iterator find(const K& key) const {
+        return Find(root, key, hasher(key));
+    }
+
+    // precomputed_hash must be hash_of(key), e.g. kept from an earlier stage
+    iterator find(const KeyType& key, size_t precomputed_hash) {
+        return Find(root, key, precomputed_hash);
+    }
+
+    const_iterator find(const KeyType& key, size_t precomputed_hash) const {
+        return Find(root, key, precomputed_hash);
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    iterator find(const K& key, size_t precomputed_hash) {
+        return Find(root, key, precomputed_hash);
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    const_iterator find(const K& key, size_t precomputed_hash) const {
+        return Find(root, key, precomputed_hash);
+    }
+
+    bool contains(const KeyType& key) const {
+        return find(key) != end();
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    bool contains(const K& key) const {
+        return find(key) != end();
+    }
+
+    bool contains(const KeyType& key, size_t precomputed_hash) const {
+        return find(key, precomputed_hash) != end();
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    bool contains(const K& key, size_t precomputed_hash) const {
+        return find(key, precomputed_hash) != end();
+    }
+
+    size_t count(const KeyType& key) const {
+        return contains(key) ? 1 : 0;
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    size_t count(const K& key) const {
+        return contains(key) ? 1 : 0;
+    }
+
+    // find for every key of [first, last), written to out in the same order; the keys are looked up
+    // BATCH_SIZE at a time, so the cache misses of different keys overlap
+    template<class KeyIterator, class OutputIterator>
+    OutputIterator find_batch(KeyIterator first, KeyIterator last, OutputIterator out) const {
+        FindBatch(first, last, [&](const const_iterator& it) {
+            *out++ = it;
+        });
+        return out;
+    }
+
+    template<class KeyIterator, class OutputIterator>
+    OutputIterator contains_batch(KeyIterator first, KeyIterator last, OutputIterator out) const {
+        FindBatch(first, last, [&](const const_iterator& it) {
+            *out++ = it != end();
+        });
+        return out;
+    }
+
+    // for long streams of keys: up to in_flight lookups are in progress, each one parked after a prefetch,
+    // and callback(key_iterator, const_iterator) is called as they finish, not in the order of the keys
+    template<class KeyIterator, class Callback>
+    void find_interleaved(KeyIterator first, KeyIterator last, Callback callback, size_t in_flight = BATCH_SIZE) const {
+        FindInterleaved(first, last, callback, in_flight);
+    }
+
+    // the root takes at once the cells that count elements need, instead of growing through every size
+    // in between, each a rebuild of the tree. Never shrinks, a leaf root that holds count stays a leaf,
+    // and erases do not shrink the root below the reserved size until clear or rehash
+    void reserve(size_t count) {
+        if (root.stupid && count <= Policy::SMALL_SIZE) {
+            return;
+        }
+        uint8_t size_id = root.SizeIdFor(count);
+        reserved_id_max_size = std::max(reserved_id_max_size, size_id);
+        if (root.stupid || size_id > root.id_max_size) {
+            EnsureArena();
+            Resize(root, size_id);
+            FinishPreparation();
+        }
+    }
+
+    // the root gets at least cells cells, but never fewer than its elements need, so it may shrink
+    // (rehash(0) fits the root to the size). A leaf root stays one unless cells > 0
+    void rehash(size_t cells) {
+        reserved_id_max_size = 0;
+        if (root.stupid && cells == 0) {
+            return;
+        }
+        uint8_t size_id = root.SizeIdFor(root.number_of_elements);
+        while (size_id + 1 < Policy::MAX_SIZE_ID && root.Sizes()[size_id] < cells) {
+            ++size_id;
+        }
+        if (root.stupid || size_id != root.id_max_size) {
+            EnsureArena();
+            Resize(root, size_id);
+            FinishPreparation();
+        }
+    }
+
+    // cells of the root, a leaf root is a single bucket
+    size_t bucket_count() const {
+        return root.stupid ? 1 : root.MaxSize();
+    }
+
+    size_t max_bucket_count() const {
+        return root.Sizes()[Policy::MAX_SIZE_ID - 1];
+    }
+
+    // elements in the subtree of root cell n; while the root migrates, also the elements of old cells
+    // that will move to it, found by a walk over all of them
+    size_t bucket_size(size_t n) const {
+        assert(n < bucket_count());
+        if (root.stupid) {
+            return root.number_of_elements;
+        }
+        const Node* child = root.Child(n);
+        size_t size = child ? child->size() : 0;
+        if (Migrating()) {
+            auto count = [&](const std::pair<const KeyType, ValueType>& element) {
+                size += GetPos(root, hasher(element.first)) == n;
+            };
+            for (const Node* cell : root.old_data) {
+                if (cell) {
+                    WalkSubtree(*cell, count);
+                }
+            }
+        }
+        return size;
+    }
+
+    float load_factor() const {
+        return static_cast<float>(root.number_of_elements) / bucket_count();
+    }
+
+    // incremental resize: the root moves to the new cell count a few old cells per insert or erase
+    // instead of rebuilding the whole tree inside a single one. Lookups (operator[] of a present key too)
+    // only read the old cells and keep references and iterators valid; an insert or erase may move
+    // any element of a migrating cell
+    void set_incremental_resize(bool enabled) {
+        if (!enabled) {
+            FinishMigration();
+        }
+        incremental = enabled;
+    }
+
+    ValueType& at(const KeyType& key) {
+        iterator it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("Out of Range error with at");
+        }
+        return it->second;
+    }
+
+    const ValueType& at(const KeyType& key) const {
+        const_iterator it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("Out of Range error with at");
+        }
+        return it->second;
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    ValueType& at(const K& key) {
+        iterator it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("Out of Range error with at");
+        }
+        return it->second;
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    const ValueType& at(const K& key) const {
+        const_iterator it = find(key);
+        if (it == end()) {
+            throw std::out_of_range("Out of Range error with at");
+        }
+        return it->second;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+    size_t size() const {
+        return root.number_of_elements;
+    }
+
+    bool insert(const std::pair<const KeyType, ValueType>& add) {
+        return TryEmplace(hasher(add.first), add.first, add.second).second;
+    }
+
+    bool insert(std::pair<const KeyType, ValueType>&& add) {
+        return TryEmplace(hasher(add.first), add.first, std::move(add.second)).second;
+    }
+
+    bool insert(const std::pair<const KeyType, ValueType>& add, size_t precomputed_hash) {
+        return TryEmplace(precomputed_hash, add.first, add.second).second;
+    }
+
+    bool insert(std::pair<const KeyType, ValueType>&& add, size_t precomputed_hash) {
+        return TryEmplace(precomputed_hash, add.first, std::move(add.second)).second;
+    }
+
+    template<class Pair, typename = std::enable_if_t<
+            std::is_constructible<std::pair<const KeyType, ValueType>, Pair&&>::value>>
+    bool insert(Pair&& add) {
+        return emplace(std::forward<Pair>(add));
+    }
+
+    // the key is needed before the leaf is known, so the pair is built once here
+    // and then moved (key included) into the leaf
+    template<class... Args>
+    bool emplace(Args&&... args) {
+        std::pair<KeyType, ValueType> element(std::forward<Args>(args)...);
+        size_t hash = hasher(element.first);
+        return TryEmplace(hash, std::move(element.first), std::move(element.second)).second;
+    }
+
+    template<class... Args>
+    bool try_emplace(const KeyType& key, Args&&... args) {
+        return TryEmplace(hasher(key), key, std::forward<Args>(args)...).second;
+    }
+
+    template<class... Args>
+    bool try_emplace(KeyType&& key, Args&&... args) {
+        size_t hash = hasher(key);
+        return TryEmplace(hash, std::move(key), std::forward<Args>(args)...).second;
+    }
+
+    // returns true if inserted, false if assigned; obj is only consumed by one of the two
+    template<class M>
+    bool insert_or_assign(const KeyType& key, M&& obj) {
+        auto result = TryEmplace(hasher(key), key, std::forward<M>(obj));
+        if (!result.second) {
+            result.first->second = std::forward<M>(obj);
+        }
+        return result.second;
+    }
+
+    template<class M>
+    bool insert_or_assign(KeyType&& key, M&& obj) {
+        size_t hash = hasher(key);
+        auto result = TryEmplace(hash, std::move(key), std::forward<M>(obj));
+        if (!result.second) {
+            result.first->second = std::forward<M>(obj);
+        }
+        return result.second;
+    }
+
+    bool erase(const KeyType& key) {
+        return Erase(root, key, hasher(key));
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    bool erase(const K& key) {
+        return Erase(root, key, hasher(key));
+    }
+
+    bool erase(const KeyType& key, size_t precomputed_hash) {
+        return Erase(root, key, precomputed_hash);
+    }
+
+    template<class K, typename = EnableTransparent<K>>
+    bool erase(const K& key, size_t precomputed_hash) {
+        return Erase(root, key, precomputed_hash);
+    }
+
+    ValueType& operator[](const KeyType& key) {
+        return TryEmplace(hasher(key), key).first->second;
+    }
+
+    ValueType& operator[](KeyType&& key) {
+        size_t hash = hasher(key);
+        return TryEmplace(hash, std::move(key)).first->second;
+    }
+
+    ValueType& operator[](const KeyType& key) const {
+        auto it = find(key);
+        if (it == end()) {
+            insert({key, ValueType{}});
+            it = find(key);
+        }
+        return it->second;
+    }
+
+
+private:
+    // the hash is computed once by the public functions and passed down the levels,
+    // K is KeyType or a type accepted by a transparent Hash
+    template<class K>
+    iterator Find(Node& node, const K& key, size_t hash) {
+        if (node.stupid) {
+            size_t i = FindSmall(node, key, hash);
+            if (i == node.small_data.size()) {
+                return end();
+            }
+            return iterator(&node.small_data[i], &node, i);
+        } else {
+            Node* child = node.Child(GetPos(node, hash));
+            if (!child) {
+                return FindNotMigrated(node, key, hash);
+            }
+            iterator it = Find(*child, key, hash);
+            return it == end() ? FindNotMigrated(node, key, hash) : it;
+        }
+    }
+
+    template<class K>
+    const_iterator Find(const Node& node, const K& key, size_t hash) const {
+        if (node.stupid) {
+            size_t i = FindSmall(node, key, hash);
+            if (i == node.small_data.size()) {
+                return end();
+            }
+            return const_iterator(&node.small_data[i], &node, i);
+        } else {
+            const Node* child = node.Child(GetPos(node, hash));
+            if (!child) {
+                return FindNotMigrated(node, key, hash);
+            }
+            const_iterator it = Find(*child, key, hash);
+            return it == end() ? FindNotMigrated(node, key, hash) : it;
+        }
+    }
+
+    enum class ProbeStage : uint8_t {
+        Node, // the node is prefetched, its kind decides what comes next
+        Cell, // the cell of the key in data is prefetched
+        Leaf, // the keys of the leaf are prefetched
+        Done,
+    };
+
+    // a lookup suspended between two memory accesses: every Step reads what the previous one prefetched
+    template<class KeyIterator>
+    struct Probe {
+        KeyIterator key;
+        size_t hash;
+        size_t position;
+        const Node* node;
+        ProbeStage stage;
+        const_iterator found;
+    };
+
+    template<class KeyIterator>
+    void StartProbe(Probe<KeyIterator>& probe, KeyIterator key) const {
+        probe.key = key;
+        probe.hash = hasher(*key);
+        probe.node = &root;
+        probe.stage = ProbeStage::Node;
+    }
+
+    // true once probe.found is the result
+    template<class KeyIterator>
+    bool StepProbe(Probe<KeyIterator>& probe) const {
+        const Node* node = probe.node;
+        switch (probe.stage) {
+            case ProbeStage::Node:
+                if (node->stupid) {
+                    Prefetch(node->small_index.data());
+                    Prefetch(node->small_data.data());
+                    probe.stage = ProbeStage::Leaf;
+                    return false;
+                }
+                if (IsRoot(*node) && Migrating()) {
+                    // rare, the old cells are searched the usual way
+                    probe.found = Find(*node, *probe.key, probe.hash);
+                    probe.stage = ProbeStage::Done;
+                    return true;
+                }
+                probe.position = GetPos(*node, probe.hash);
+                node->PrefetchCell(probe.position);
+                probe.stage = ProbeStage::Cell;
+                return false;
+            case ProbeStage::Cell:
+                probe.node = node->Child(probe.position);
+                if (!probe.node) {
+                    probe.found = end();
+                    probe.stage = ProbeStage::Done;
+                    return true;
+                }
+                Prefetch(probe.node);
+                Prefetch(&probe.node->data);
+                probe.stage = ProbeStage::Node;
+                return false;
+            case ProbeStage::Leaf: {
+                size_t i = FindSmall(*node, *probe.key, probe.hash);
+                probe.found = i == node->small_data.size() ? end() : const_iterator(&node->small_data[i], node, i);
+                probe.stage = ProbeStage::Done;
+                return true;
+            }
+            case ProbeStage::Done:
+                break;
+        }
+        return true;
+    }
+
+    // the keys of a group advance one step per round, the results are emitted in the order of the keys
+    template<class KeyIterator, class Emit>
+    void FindBatch(KeyIterator first, KeyIterator last, Emit emit) const {
+        Probe<KeyIterator> probes[BATCH_SIZE];
+        while (first != last) {
+            size_t count = 0;
+            for (; first != last && count < BATCH_SIZE; ++first, ++count) {
+                StartProbe(probes[count], first);
+            }
+            for (size_t active = count; active > 0;) {
+                for (size_t j = 0; j < count; ++j) {
+                    if (probes[j].stage != ProbeStage::Done && StepProbe(probes[j])) {
+                        --active;
+                    }
+                }
+            }
+            for (size_t j = 0; j < count; ++j) {
+                emit(probes[j].found);
+            }
+        }
+    }
+
+    // no group barrier: a finished probe hands its slot to the next key at once
+    template<class KeyIterator, class Callback>
+    void FindInterleaved(KeyIterator first, KeyIterator last, Callback& callback, size_t in_flight) const {
+        Probe<KeyIterator> probes[MAX_IN_FLIGHT];
+        in_flight = std::min<size_t>(std::max<size_t>(in_flight, 1), MAX_IN_FLIGHT);
+        size_t active = 0;
+        for (; first != last && active < in_flight; ++first) {
+            StartProbe(probes[active++], first);
+        }
+        while (active > 0) {
+            for (size_t j = 0; j < active;) {
+                if (!StepProbe(probes[j])) {
+                    ++j;
+                    continue;
+                }
+                callback(probes[j].key, probes[j].found);
+                if (first != last) {
+                    StartProbe(probes[j++], first);
+                    ++first;
+                } else {
+                    probes[j] = probes[--active];
+                }
+            }
+        }
+    }
+
+    template<class K>
+    bool Erase(Node& node, const K& key, size_t hash) {
+        if (node.stupid) {
+            size_t i = FindSmall(node, key, hash);
+            if (i == node.small_data.size()) {
+                return false;
+            }
+            node.EraseSmall(i);
+            --node.number_of_elements;
+            return true;
+        } else {
+            if (IsRoot(node)) {
+                MigrateStep();
+                MigrateCellOf(hash);
+            }
+            size_t pos = GetPos(node, hash);
+            Node* child = node.Child(pos);
+            if (child && Erase(*child, key, hash)) {
+                --node.number_of_elements;
+                if (child->empty()) {
+                    --node.open_cells;
+                    DeleteNode(child);
+                    node.SetCell(pos, nullptr);
+                    if (!(IsRoot(node) && Migrating()) && node.open_cells * Policy::SHRINK_DIV <= node.MaxSize()) {
+                        Reduce(node);
+                    }
+                }
+                return true;
+            }
+            return false;
+        }
+    }
+
+    template<class K, class... Args>
+    std::pair<iterator, bool> TryEmplace(size_t hash, K&& key, Args&&... args) {
+        EnsureArena();
+        if (Migrating()) {
+            // an existing key is a lookup, which does not migrate
+            iterator it = Find(root, key, hash);
+            if (it != end()) {
+                return {it, false};
+            }
+        }
+        return TryEmplace(root, hash, std::forward<K>(key), std::forward<Args>(args)...);
+    }
+
+    // only the leaf that finally stores the element consumes key and args,
+    // the pair is constructed in place in its small_data. Nodes grow before the element
+    // goes in, so the returned iterator (to the new or the existing element) stays valid.
+    template<class K, class... Args>
+    std::pair<iterator, bool> TryEmplace(Node& node, size_t hash, K&& key, Args&&... args) {
+        if (node.stupid) {
+            size_t i = FindSmall(node, key, hash);
+            if (i != node.small_data.size()) {
+                return {iterator(&node.small_data[i], &node, i), false};
             }
-            if (static_cast<size_t>(index + 1) < map->size()) {
-                *this = iterator(&(map->small_data[index+1]), from, index + 1, local_recursive_level);
-                return *this;
+            if (node.LastLevel() || node.number_of_elements + 1 <= Policy::SMALL_SIZE) {
+                size_t i = node.EmplaceSmall(hash, std::piecewise_construct,
+                                             std::forward_as_tuple(std::forward<K>(key)),
+                                             std::forward_as_tuple(std::forward<Args>(args)...));
+                node.number_of_elements++;
+                return {iterator(&node.small_data[i], &node, i), true};
+            }
+            Expand(node);
+        }
+        if (IsRoot(node)) {
+            MigrateStep();
+            MigrateCellOf(hash);
+        }
+        size_t pos = GetPos(node, hash);
+        Node* child = node.Child(pos);
+        if (!child && (node.open_cells + 1) * Policy::MAX_SIZE_DIV_NUMBER_OF_ELEMENTS >= node.MaxSize()) {
+            // the key is absent and takes a new cell
+            Expand(node, 1);
+            if (IsRoot(node)) {
+                MigrateCellOf(hash);
             }
+            pos = GetPos(node, hash);
+            child = node.Child(pos);
+        }
+        if (!child) {
+            ++node.open_cells;
+            node.SetCell(pos, child = NewNode(node, pos));
+        }
+        auto result = TryEmplace(*child, hash, std::forward<K>(key), std::forward<Args>(args)...);
+        if (result.second) {
+            ++node.number_of_elements;
+        }
+        return result;
+    }
 
-            size_t id;
-            while(map->recursive_level > local_recursive_level) {
-                id = map->from_index + 1;
-                map = map->parent;
-                while (id < map->max_size)  {
+    // the key is const only for the user, an element that is about to be destroyed
+    // gives it away instead of being copied
+    static KeyType&& MovableKey(std::pair<const KeyType, ValueType>& element) {
+        return std::move(const_cast<KeyType&>(element.first));
+    }
 
-                    if (map->data[id].get() && !map->data[id].get()->empty()) {
-                        *this = iterator(map->data[id].get()->begin(), local_recursive_level);
-                        return *this;
+    static IndexEntry IndexOf(const KeyType& key, size_t hash) {
+        if constexpr (SIMD_KEYS) {
+            return key;
+        } else {
+            return simd::Tag(hash);
+        }
+    }
+
+    // index of the key in small_data of the leaf or small_data.size()
+    template<class K>
+    size_t FindSmall(const Node& node, const K& key, size_t hash) const {
+        const SmallVector& small_data = node.small_data;
+        if constexpr (SORTED_KEYS && is_less_comparable<KeyType, K>::value && is_less_comparable<K, KeyType>::value) {
+            if (node.order) {
+                auto range = node.order->positions.equal_range(OrderProbe<K>{key});
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (key_equal(small_data[*it].first, key)) {
+                        return *it;
                     }
-                    ++id;
                 }
+                return small_data.size();
             }
-            *this = end();
-            return *this;
         }
-        iterator operator++(int) {
-            iterator result = *this;
-            ++(*this);
-            return result;
+        if constexpr (SIMD_KEYS && std::is_same<K, KeyType>::value) {
+            if (node.LastLevel()) {
+                return simd::Find(node.small_index.data(), node.small_index.size(), key);
+            }
+        } else if constexpr (!SIMD_KEYS) {
+            return simd::FindTag(node.small_index.data(), node.small_index.size(), simd::Tag(hash), [&](size_t i) {
+                return key_equal(small_data[i].first, key);
+            });
         }
-    private:
-        ItValueType* value;
-        HashMap* from;
-        uint8_t index{};
-        uint8_t local_recursive_level{};
-    };
-
-    struct const_iterator {
-        using ItValueType = const std::pair<const KeyType, ValueType>;
-        explicit const_iterator() = default;
+        for (size_t i = 0; i < small_data.size(); ++i) {
+            if (key_equal(small_data[i].first, key)) {
+                return i;
+            }
+        }
+        return small_data.size();
+    }
 
-        explicit const_iterator(ItValueType* _value, const HashMap* _from, uint8_t id, uint8_t rec_level = 0) : value(_value), from(_from), index(id), local_recursive_level(rec_level) {}
+    // the element is known to be absent from this subtree, key and value are moved
+    void Relocate(Node& node, std::pair<const KeyType, ValueType>& element) {
+        Relocate(node, element, hasher(element.first));
+    }
 
-        const_iterator(const const_iterator& other) : const_iterator(other.value, other.from, other.index, other.local_recursive_level) {}
-        const_iterator(const const_iterator& other, uint8_t rec_level) : const_iterator(other.value, other.from, other.index, rec_level) {}
+    void Relocate(Node& node, std::pair<const KeyType, ValueType>& element, size_t hash) {
+        if (node.stupid) {
+            node.EmplaceSmall(hash, MovableKey(element), std::move(element.second));
+            node.number_of_elements++;
+            if (!node.LastLevel() && node.number_of_elements > Policy::SMALL_SIZE) {
+                Expand(node);
+            }
+        } else {
+            size_t pos = GetPos(node, hash);
+            Node* child = node.Child(pos);
+            if (!child) {
+                ++node.open_cells;
+                node.SetCell(pos, child = NewNode(node, pos));
+            }
+            Relocate(*child, element, hash);
+            ++node.number_of_elements;
+            if (node.open_cells * Policy::MAX_SIZE_DIV_NUMBER_OF_ELEMENTS >= node.MaxSize()) {
+                Expand(node);
+            }
+        }
+    }
 
-        bool operator==(const const_iterator &other) {
-            return value == other.value && local_recursive_level == other.local_recursive_level;
+    // moves every element of the subtree of node to target, nodes are freed as soon as they are drained
+    void MoveElementsTo(Node& node, Node& target) {
+        if (node.stupid) {
+            for (auto& element : node.small_data) {
+                Relocate(target, element);
+            }
+            node.DropOrder();
+            node.small_data.clear();
+            node.small_index.clear();
+            return;
         }
-        bool operator!=(const const_iterator &other) {
-            return !(*this == other);
+        for (auto& child : node.data) {
+            if (child) {
+                MoveElementsTo(*child, target);
+                DeleteNode(child);
+                child = nullptr;
+            }
         }
+        FreeVector(node.data);
+        FreeVector(node.occupied);
+    }
 
-
-        ItValueType& operator*() const {
-            return *value;
+    // refills the node (already switched to its new size) from its previous contents
+    void Rebuild(Node& node, SmallVector& previous_small, NodeVector& previous_data) {
+        node.number_of_elements = 0;
+        if (!node.stupid) {
+            node.open_cells = 0;
         }
-        ItValueType* operator->() const {
-            return value;
+        for (auto& element : previous_small) {
+            Relocate(node, element);
+        }
+        previous_small.clear();
+        for (auto& child : previous_data) {
+            if (child && !TryRelink(node, child)) {
+                MoveElementsTo(*child, node);
+                DeleteNode(child);
+                child = nullptr;
+            }
         }
+    }
 
-        const_iterator& operator=(const const_iterator& other) {
-            if (&other == this) {
-                return *this;
+    // an old leaf whose elements all land in the same free cell is moved over as a whole
+    bool TryRelink(Node& node, Node*& child) {
+        Node* leaf = child;
+        if (node.stupid || !leaf->stupid) {
+            return false;
+        }
+        size_t pos = GetPos(node, hasher(leaf->small_data[0].first));
+        if (node.Child(pos)) {
+            return false;
+        }
+        for (size_t i = 1; i < leaf->small_data.size(); ++i) {
+            if (GetPos(node, hasher(leaf->small_data[i].first)) != pos) {
+                return false;
             }
-            value = other.value;
-            from = other.from;
-            index = other.index;
-            local_recursive_level = other.local_recursive_level;
-            return *this;
         }
+        leaf->from_index = static_cast<uint32_t>(pos);
+        node.SetCell(pos, child);
+        child = nullptr;
+        ++node.open_cells;
+        node.number_of_elements += leaf->size();
+        if (node.open_cells * Policy::MAX_SIZE_DIV_NUMBER_OF_ELEMENTS >= node.MaxSize()) {
+            Expand(node);
+        }
+        return true;
+    }
 
-        const_iterator end() {
-            return const_iterator();
+    // children allocate from the arena of their parent
+    static Node* NewNode(Node& parent, size_t pos) {
+        return NewNode(parent, pos, parent.Storage());
+    }
+
+    // a child that another thread fills, it and its descendants allocate from node_arena
+    static Node* NewNode(Node& parent, size_t pos, Arena* node_arena) {
+        void* memory = node_arena->allocate(sizeof(Node));
+        return new (memory) Node(parent.recursive_level + 1, pos, &parent, node_arena);
+    }
+
+    template<class Iterator>
+    void BuildParallel(Iterator first, Iterator last, ThreadPool& pool) {
+        static_assert(std::is_base_of<std::random_access_iterator_tag,
+                              typename std::iterator_traits<Iterator>::iterator_category>::value,
+                      "parallel construction needs random access iterators");
+        const size_t size = last - first;
+        // the tasks fill cells in place, a compact root would be shifted under them
+        if (pool.size() == 1 || size < PARALLEL_BUILD_MIN || root.Sizes()[root.SizeIdFor(size)] <= Policy::COMPACT_MAX_CELLS) {
+            for (Iterator it = first; it != last; ++it) {
+                emplace(*it);
+            }
+            return;
         }
+        EnsureArena();
+        root.BecomeInner();
+        root.id_max_size = root.SizeIdFor(size);
+        root.ResetCells();
+        const size_t max_size = root.MaxSize();
 
-        const_iterator& operator++() {
-            if (*this == end()) {
-                return *this;
+        // input chunk c counts its elements per cell range r, the counts become the offsets
+        // of the chunk in the range, so every range lists its elements in input order
+        const size_t ranges = pool.size() * PARALLEL_TASKS_PER_THREAD;
+        const size_t chunk = (size + ranges - 1) / ranges;
+        std::vector<size_t> hashes(size);
+        std::vector<uint32_t> cells(size);
+        std::vector<size_t> offsets(ranges * ranges);
+        auto range_of = [&](size_t cell) {
+            return cell * ranges / max_size;
+        };
+        pool.ParallelFor(ranges, [&](size_t c) {
+            for (size_t i = c * chunk; i < std::min(size, (c + 1) * chunk); ++i) {
+                hashes[i] = hasher(first[i].first);
+                cells[i] = static_cast<uint32_t>(GetPos(root, hashes[i]));
+                ++offsets[c * ranges + range_of(cells[i])];
             }
-            const HashMap* map = from;
-            if (!map->stupid) {
-                *this = end();
-                return *this;
+        });
+        std::vector<size_t> range_begin(ranges + 1, size);
+        size_t offset = 0;
+        for (size_t r = 0; r < ranges; ++r) {
+            range_begin[r] = offset;
+            for (size_t c = 0; c < ranges; ++c) {
+                size_t count = offsets[c * ranges + r];
+                offsets[c * ranges + r] = offset;
+                offset += count;
             }
-            if (static_cast<size_t>(index + 1) < map->size()) {
-                *this = const_iterator(&(map->small_data[index+1]), from, index + 1, local_recursive_level);
-                return *this;
+        }
+        std::vector<size_t> order(size);
+        pool.ParallelFor(ranges, [&](size_t c) {
+            for (size_t i = c * chunk; i < std::min(size, (c + 1) * chunk); ++i) {
+                order[offsets[c * ranges + range_of(cells[i])]++] = i;
             }
+        });
 
-            size_t id;
-            while(map->recursive_level > local_recursive_level) {
-                id = map->from_index + 1;
-                map = map->parent;
-                while (id < map->max_size)  {
-
-                    if (map->data[id].get() && !map->data[id].get()->empty()) {
-                        *this = const_iterator(map->data[id].get()->begin(true), local_recursive_level);
-                        return *this;
-                    }
-                    ++id;
+        // the cells of a range belong to its task only; the first of equal keys wins, as with insert
+        std::vector<Arena*> arenas(ranges, nullptr);
+        std::vector<size_t> inserted(ranges), opened(ranges);
+        auto adopt = [&] {
+            for (size_t r = 0; r < ranges; ++r) {
+                if (arenas[r]) {
+                    own_arena->adopt(arenas[r]);
                 }
+                root.number_of_elements += inserted[r];
+                root.open_cells += static_cast<uint32_t>(opened[r]);
             }
-            *this = end();
-            return *this;
-        }
-        const_iterator operator++(int) {
-            const_iterator result = *this;
-            ++(*this);
-            return result;
+            // a word of the bitmap spans the cells of two ranges, so the tasks leave it alone
+            for (size_t pos = 0; pos < max_size; ++pos) {
+                if (root.data[pos]) {
+                    root.SetCell(pos, root.data[pos]);
+                }
+            }
+        };
+        try {
+            pool.ParallelFor(ranges, [&](size_t r) {
+                auto begin = order.begin() + range_begin[r], end = order.begin() + range_begin[r + 1];
+                if (begin == end) {
+                    return;
+                }
+                std::stable_sort(begin, end, [&](size_t a, size_t b) {
+                    return cells[a] < cells[b];
+                });
+                arenas[r] = Arena::Create(allocator);
+                for (auto it = begin; it != end; ++it) {
+                    size_t pos = cells[*it];
+                    if (!root.data[pos]) {
+                        root.data[pos] = NewNode(root, pos, arenas[r]);
+                        ++opened[r];
+                    }
+                    inserted[r] += TryEmplace(*root.data[pos], hashes[*it], first[*it].first, first[*it].second).second;
+                }
+            });
+        } catch (...) {
+            adopt();
+            throw;
         }
-    private:
-        ItValueType* value;
-        const HashMap* from;
-        uint8_t index{};
-        uint8_t local_recursive_level{};
-    };
+        adopt();
+    }
 
-    iterator begin() {
-        if (number_of_elements == 0) {
-            return end();
+    // range(r, walk) for each of the pool.size() * PARALLEL_TASKS_PER_THREAD ranges of root cells,
+    // walk(f) calls f on every element of the range. A leaf root is the single range 0
+    template<class Self, class Range>
+    static void ForEachRootRange(Self& self, ThreadPool& pool, Range range) {
+        using NodeType = std::conditional_t<std::is_const<Self>::value, const Node, Node>;
+        NodeType& root = self.root;
+        if (root.stupid) {
+            range(0, [&](auto&& f) {
+                WalkSubtree(root, f);
+            });
+            return;
         }
-        if (stupid) {
-            return iterator(&small_data[0], this, 0);
-        } else {
-            for (size_t i = 0;; ++i) {
-                if (data[i].get() && !data[i].get()->empty()) {
-                    return iterator(data[i].get()->begin(), recursive_level);
+        const size_t ranges = pool.size() * PARALLEL_TASKS_PER_THREAD;
+        const size_t cells = root.CellCount();
+        pool.ParallelFor(ranges, [&](size_t r) {
+            range(r, [&](auto&& f) {
+                const size_t last = cells * (r + 1) / ranges;
+                for (size_t id = root.NextCell(cells * r / ranges); id < last; id = root.NextCell(id + 1)) {
+                    WalkSubtree(static_cast<NodeType&>(*root.Cell(id)), f);
                 }
+            });
+        });
+    }
+
+    template<class NodeType, class F>
+    static void WalkSubtree(NodeType& node, F& f) {
+        if (node.stupid) {
+            for (auto& element : node.small_data) {
+                f(element);
             }
+            return;
+        }
+        for (size_t id = node.NextCell(0); id < node.CellCount(); id = node.NextCell(id + 1)) {
+            WalkSubtree(static_cast<NodeType&>(*node.Cell(id)), f);
         }
     }
-    const_iterator begin(bool inner = false) const {
-        if (number_of_elements == 0) {
-            return end();
+
+    // the first element of the subtree of a non empty node
+    template<class Iterator, class NodeType>
+    static Iterator First(NodeType* node) {
+        while (!node->stupid) {
+            size_t id = node->NextCell(0);
+            while (node->Cell(id)->empty()) {
+                id = node->NextCell(id + 1);
+            }
+            node = node->Cell(id);
         }
-        if (stupid) {
-            return const_iterator(&small_data[0], this, 0);
-        } else {
-            for (size_t i = 0;; ++i) {
-                if (data[i].get() && !data[i].get()->empty()) {
-                    return const_iterator(data[i].get()->begin(true), recursive_level);
-                }
+        return Iterator(&node->small_data[0], node, 0);
+    }
+
+    // the subtree goes back to the arena the node came from
+    static void DeleteNode(Node* node) {
+        DeleteChildren(*node);
+        Arena* node_arena = node->Storage();
+        node->~Node();
+        node_arena->deallocate(node, sizeof(Node));
+    }
+
+    static void DeleteChildren(Node& node) {
+        if (node.stupid) {
+            return;
+        }
+        for (auto& child : node.data) {
+            if (child) {
+                DeleteNode(child);
+                child = nullptr;
             }
         }
+        std::fill(node.occupied.begin(), node.occupied.end(), 0);
     }
 
-    iterator end() {
-        return iterator();
+    void DeleteTree() {
+        DeleteChildren(root);
+        for (auto& child : root.old_data) {
+            if (child) {
+                DeleteNode(child);
+                child = nullptr;
+            }
+        }
+        std::fill(root.old_occupied.begin(), root.old_occupied.end(), 0);
     }
-    const_iterator end() const {
-        return const_iterator();
+
+    // releases a vector's memory to its allocator, clear() keeps the capacity
+    template<class Vector>
+    static void FreeVector(Vector& vector) {
+        Vector(vector.get_allocator()).swap(vector);
     }
 
-    Hash hash_function() const {
-        return hasher;
+    // the arena went to another map together with the tree, this one gets a new one
+    // when it allocates next time (moves do not allocate)
+    void DropArena() noexcept {
+        UseArena(nullptr);
     }
 
-    iterator find(const KeyType& key) {
-        if (stupid) {
-            for (size_t i = 0; i < small_data.size(); ++i) {
-                if (small_data[i].first == key) {
-                    return iterator(&small_data[i], this, i);
-                }
-            }
-            return end();
+    void EnsureArena() {
+        if (own_arena) {
+            return;
+        }
+        own_arena.reset(Arena::Create(allocator));
+        UseArena(own_arena.get());
+    }
+
+    // the vectors of the root have to be empty
+    void UseArena(Arena* arena) noexcept {
+        if (root.stupid) {
+            root.small_data = SmallVector(ArenaAllocator<char, Arena>(arena));
+            root.small_index = IndexVector(ArenaAllocator<char, Arena>(arena));
         } else {
-            size_t pos = GetPos(key);
-            if (!data[pos]) {
-                return end();
-            }
-            return data[pos].get()->find(key);
+            root.data = NodeVector(ArenaAllocator<char, Arena>(arena));
+            root.occupied = BitVector(ArenaAllocator<char, Arena>(arena));
         }
+        root.old_data = NodeVector(ArenaAllocator<char, Arena>(arena));
+        root.old_occupied = BitVector(ArenaAllocator<char, Arena>(arena));
     }
 
-    const_iterator find(const KeyType& key, bool flag = true) const {
-        if (stupid) {
-            for (size_t i = 0; i < small_data.size(); ++i) {
-                if (small_data[i].first == key) {
-                    return const_iterator(&small_data[i], this, i);
+    void AdoptChildren() {
+        if (!root.stupid) {
+            for (auto& child : root.data) {
+                if (child) {
+                    child->parent = &root;
                 }
             }
-            return end();
-        } else {
-            size_t pos = GetPos(key);
-            if (!data[pos]) {
-                return end();
+        }
+        for (auto& child : root.old_data) {
+            if (child) {
+                child->parent = &root;
             }
-            return data[pos].get()->find(key, true);
         }
     }
 
-    ValueType& at(const KeyType& key) {
-        iterator it = find(key);
-        if (it == end()) {
-            throw std::out_of_range("Out of Range error with at");
+    bool IsRoot(const Node& node) const {
+        return &node == &root;
+    }
+
+    bool Migrating() const {
+        return !root.old_data.empty();
+    }
+
+    // the first set bit from bit on, size if there is none
+    static size_t NextBit(const BitVector& bits, size_t bit, size_t size) {
+        if (bit >= size) {
+            return size;
         }
-        return it->second;
+        size_t word = bit / 64;
+        uint64_t rest = bits[word] & (~uint64_t(0) << (bit % 64));
+        while (!rest) {
+            if (++word == bits.size()) {
+                return size;
+            }
+            rest = bits[word];
+        }
+        return word * 64 + CountTrailingZeros(rest);
     }
 
-    const ValueType& at(const KeyType& key) const {
-        const_iterator it = find(key);
-        if (it == end()) {
-            throw std::out_of_range("Out of Range error with at");
+    // the old root cell of the hash while the root is migrating, nullptr for any other node
+    Node* OldCellOf(const Node& node, size_t hash) const {
+        if (!IsRoot(node) || !Migrating()) {
+            return nullptr;
         }
-        return it->second;
+        return root.old_data[GetPos(root, hash, old_id_max_size)];
     }
 
-    bool empty() const {
-        return size() == 0;
+    template<class K>
+    iterator FindNotMigrated(const Node& node, const K& key, size_t hash) {
+        Node* cell = OldCellOf(node, hash);
+        return cell ? Find(*cell, key, hash) : end();
     }
-    size_t size() const {
-        return number_of_elements;
+
+    template<class K>
+    const_iterator FindNotMigrated(const Node& node, const K& key, size_t hash) const {
+        const Node* cell = OldCellOf(node, hash);
+        return cell ? Find(*cell, key, hash) : end();
     }
 
-    bool insert(const std::pair<const KeyType, ValueType>& add) {
-        if (stupid) {
-            for (const auto& [key, value] : small_data) {
-                if (key == add.first) return false;
-            }
-            small_data.emplace_back(add);
-            number_of_elements++;
-            if (!LastLevel() && number_of_elements * MAX_SIZE_DIV_NUMBER_OF_ELEMENTS >= max_sizes[id_max_size]) {
-                Expand();
-            }
-            return true;
-        } else {
-            const auto& [key, value] = add;
-            size_t pos = GetPos(key);
-            if (!data[pos]) {
-                ++open_cells;
-                data[pos] = std::make_unique<HashMap<KeyType, ValueType, Hash>>(hasher, recursive_level + 1, pos, this);
-            }
-            if (data[pos].get()->insert(add)) {
-                ++number_of_elements;
-                if (open_cells * MAX_SIZE_DIV_NUMBER_OF_ELEMENTS >= max_size) {
-                    Expand();
-                }
-                return true;
-            }
-            return false;
+    // incremental resize, first part: the cells of the new size are zeroed a chunk per insert or erase
+    // (filling a big root at once is a stall of its own) while the root keeps using its current cells
+    void PrepareMigration(uint8_t size_id) {
+        next_id_max_size = size_id;
+        const size_t cells = root.Sizes()[size_id];
+        void* memory = root.Storage()->allocate(sizeof(NodeVector));
+        next_cells = new (memory) NodeVector(root.data.get_allocator());
+        if (cells > Policy::COMPACT_MAX_CELLS) {
+            next_cells->reserve(cells);
+        }
+        PrepareStep(0);
+    }
+
+    void PrepareStep(size_t cells) {
+        const size_t size = root.Sizes()[next_id_max_size];
+        const size_t target = size > Policy::COMPACT_MAX_CELLS ? size : 0;
+        next_cells->resize(next_cells->size() + std::min(cells, target - next_cells->size()), nullptr);
+        if (next_cells->size() == target) {
+            StartMigration();
         }
+    }
 
+    void FinishPreparation() {
+        if (next_cells) {
+            PrepareStep(SIZE_MAX);
+        }
     }
 
-    bool erase(const KeyType& key) {
-        if (stupid) {
-            bool has = false;
-            for (size_t i = 0; i < small_data.size(); ++i) {
-                if (small_data[i].first == key) {
-                    has = true;
-                }
-            }
-            if (!has) {
-                return false;
-            }
-            --number_of_elements;
-            std::vector<std::pair<const KeyType, ValueType>> temp = small_data;
-            small_data.clear();
-            for (const auto& element : temp) if (element.first != key) {
-                small_data.emplace_back(element);
-            }
-            return true;
-        } else {
-            size_t pos = GetPos(key);
-            if (data[pos] && data[pos].get()->erase(key)) {
-                --number_of_elements;
-                if (data[pos].get()->empty()) {
-                    --open_cells;
-                    data[pos] = nullptr;
-                    if (open_cells * MAX_SIZE_DIV_NUMBER_OF_ELEMENTS * MAX_SIZE_DIV_NUMBER_OF_ELEMENTS <= max_size) {
-                        Reduce();
-                    }
-                }
-                return true;
+    void DropNextCells() noexcept {
+        if (next_cells) {
+            next_cells->~NodeVector();
+            root.Storage()->deallocate(next_cells, sizeof(NodeVector));
+            next_cells = nullptr;
+        }
+    }
+
+    // second part: the root takes the prepared cells and moves its old ones to them a few per operation
+    void StartMigration() {
+        migrated = 0;
+        old_id_max_size = root.id_max_size;
+        root.id_max_size = next_id_max_size;
+        root.old_data.swap(root.data);
+        root.old_occupied.swap(root.occupied);
+        const size_t old_cells = root.Sizes()[old_id_max_size];
+        if (old_cells <= Policy::COMPACT_MAX_CELLS) {
+            NodeVector cells(old_cells, nullptr, root.data.get_allocator());
+            for (size_t i = 0, pos = NextBit(root.old_occupied, 0, old_cells); i < root.old_data.size(); ++i) {
+                cells[pos] = root.old_data[i];
+                pos = NextBit(root.old_occupied, pos + 1, old_cells);
             }
-            return false;
+            root.old_data.swap(cells);
         }
+        root.data.swap(*next_cells);
+        DropNextCells();
+        root.occupied = BitVector((root.MaxSize() + 63) / 64, 0, root.occupied.get_allocator());
+        root.open_cells = 0;
     }
 
-    ValueType& operator[](const KeyType& key) {
-        auto it = find(key);
-        if (it == end()) {
-            insert({key, ValueType{}});
-            it = find(key);
+    // the subtree of an old cell goes to the new cells, elements are counted again on the way in
+    void MigrateCell(size_t cell) {
+        if (!root.old_data[cell]) {
+            return;
+        }
+        Node* child = root.old_data[cell];
+        root.old_data[cell] = nullptr;
+        root.old_occupied[cell / 64] &= ~(uint64_t(1) << (cell % 64));
+        root.number_of_elements -= child->size();
+        if (!TryRelink(root, child)) {
+            MoveElementsTo(*child, root);
+            DeleteNode(child);
         }
-        return it->second;
     }
 
-    ValueType& operator[](const KeyType& key) const {
-        auto it = find(key);
-        if (it == end()) {
-            insert({key, ValueType{}});
-            it = find(key);
+    // a key is only ever looked for in its new cell once its old cell is migrated
+    void MigrateCellOf(size_t hash) {
+        if (Migrating()) {
+            MigrateCell(GetPos(root, hash, old_id_max_size));
+            if (Migrating() && migrated == root.old_data.size()) {
+                FreeVector(root.old_data);
+                FreeVector(root.old_occupied);
+            }
+        }
+    }
+
+    void MigrateStep(size_t cells = MIGRATION_CELLS_PER_OPERATION) {
+        if (next_cells) {
+            PrepareStep(cells * PREPARED_CELLS_PER_OPERATION / MIGRATION_CELLS_PER_OPERATION);
+            return;
+        }
+        for (size_t step = 0; step < cells && Migrating(); ++step) {
+            size_t cell = migrated++;
+            MigrateCell(cell);
+            if (Migrating() && migrated == root.old_data.size()) {
+                FreeVector(root.old_data);
+                FreeVector(root.old_occupied);
+            }
         }
-        return it->second;
     }
 
+    void FinishMigration() {
+        FinishPreparation();
+        while (Migrating()) {
+            MigrateStep(root.old_data.size());
+        }
+    }
 
-private:
-    bool LastLevel() {
-        return recursive_level + 1 == MAX_RECURSIVE_LEVEL;
+    size_t GetPos(const Node& node, size_t hash) const {
+        return GetPos(node, hash, node.id_max_size);
     }
 
-    size_t GetPos(const KeyType& key) const {
-        return static_cast<size_t>((static_cast<long long>(hasher(key) % max_size) * (increase % max_size)) % max_size);
+    size_t GetPos(const Node& node, size_t hash, uint8_t size_id) const {
+        return CellOf<Policy>(hash, seed, node.recursive_level, size_id);
     }
 
-    void Expand() {
-        if (id_max_size + 1 == MAX_SIZE_ID) return;
-        std::vector<std::pair<KeyType, ValueType>> to_add;
-        if (stupid) {
-            for (const auto& element : small_data) {
-                to_add.emplace_back(element);
+    // new_cells: cells that the insert which triggered the growth is about to open
+    void Expand(Node& node, size_t new_cells = 0) {
+        if (node.id_max_size + 1 == Policy::MAX_SIZE_ID) return;
+        if (incremental && IsRoot(node) && !node.stupid) {
+            if (next_cells) {
+                // the root grows as soon as its next cells are ready
+                return;
             }
-            small_data.clear();
-            stupid = false;
-        } else {
-            for (const auto& element : *this) {
-                to_add.emplace_back(element);
+            FinishMigration();
+            if ((node.open_cells + new_cells) * Policy::MAX_SIZE_DIV_NUMBER_OF_ELEMENTS < node.MaxSize()) {
+                return;
             }
         }
-        ++id_max_size;
-        max_size = max_sizes[id_max_size];
-        data.clear();
-        data = std::vector<std::unique_ptr<HashMap>>(max_size);
-        number_of_elements = 0;
-        open_cells = 0;
-        for (auto& element : to_add) {
-            insert(element);
-        }
+        // a full leaf takes at once the size its elements and the one coming need
+        Resize(node, node.stupid ? node.SizeIdFor(node.number_of_elements + 1) : node.id_max_size + 1);
     }
 
-    void Reduce() {
-        if (id_max_size == 0) {
+    void Reduce(Node& node) {
+        if (node.id_max_size == 0 || (IsRoot(node) && (node.id_max_size <= reserved_id_max_size || next_cells))) {
             return;
         }
-        std::vector<std::pair<KeyType, ValueType>> to_add;
-        for (const auto& element : *this) {
-            to_add.emplace_back(element);
-        }
-        if (id_max_size == 1 && number_of_elements * MAX_SIZE_DIV_NUMBER_OF_ELEMENTS < max_sizes[0]) {
-            stupid = true;
-            max_size = max_sizes[id_max_size = 0];
-            data.clear();
-            small_data.clear();
-            for (const auto& element : to_add) {
-                insert(element);
-            }
+        if (node.id_max_size > 1 || node.number_of_elements > Policy::SMALL_SIZE) {
+            Resize(node, node.id_max_size - 1);
             return;
         }
+        SmallVector previous_small(ArenaAllocator<char, Arena>(node.Storage()));
+        NodeVector previous_data(ArenaAllocator<char, Arena>(node.Storage()));
+        previous_data.swap(node.data);
+        node.BecomeLeaf();
+        node.id_max_size = 0;
+        Rebuild(node, previous_small, previous_data);
+    }
 
-        max_size = max_sizes[--id_max_size];
-        data.clear();
-        data = std::vector<std::unique_ptr<HashMap>>(max_size);
-        number_of_elements = 0;
-        open_cells = 0;
-        for (auto& element : to_add) {
-            insert(element);
+    // the node becomes inner with the cells of size_id (> 0), straight from any size:
+    // rebuilt at once, or, for the root with incremental resize, migrated cell by cell
+    void Resize(Node& node, uint8_t size_id) {
+        if (incremental && IsRoot(node) && !node.stupid) {
+            FinishMigration();
+            PrepareMigration(size_id);
+            return;
+        }
+        SmallVector previous_small(ArenaAllocator<char, Arena>(node.Storage()));
+        NodeVector previous_data(ArenaAllocator<char, Arena>(node.Storage()));
+        if (node.stupid) {
+            previous_small.swap(node.small_data);
+            node.BecomeInner();
+        } else {
+            previous_data.swap(node.data);
         }
+        node.id_max_size = size_id;
+        node.ResetCells();
+        Rebuild(node, previous_small, previous_data);
     }
 
 public:
     ~HashMap() {
-        data.clear();
-        small_data.clear();
+        if (!own_arena || !TRIVIAL_TEARDOWN) {
+            DeleteTree();
+        }
     }
 
     void clear() {
-        data.clear();
-        small_data.clear();
+        if (!own_arena || !TRIVIAL_TEARDOWN) {
+            DeleteTree();
+        }
+        if (!root.stupid) {
+            root.BecomeLeaf();
+        }
+        FreeVector(root.old_data);
+        FreeVector(root.old_occupied);
+        DropNextCells();
+        root.DropOrder();
+        FreeVector(root.small_data);
+        FreeVector(root.small_index);
+        if (own_arena) {
+            own_arena->release();
+        }
+        migrated = 0;
+        reserved_id_max_size = 0;
 
-        max_size = max_sizes[id_max_size = 0];
-        increase = increase_primes[recursive_level = 0];
-        open_cells = 0;
-        number_of_elements = 0;
-        stupid = true;
-        parent = nullptr;
-        from_index = 0;
+        root.id_max_size = 0;
+        root.number_of_elements = 0;
     }
 
     HashMap& operator=(const HashMap& other) {
@@ -507,36 +2525,103 @@ public:
             return *this;
         }
         clear();
-        if (other.stupid) {
+        hasher = other.hasher;
+        key_equal = other.key_equal;
+        if constexpr (AllocatorTraits::propagate_on_container_copy_assignment::value) {
+            if (allocator != other.allocator) {
+                DropArena();
+                own_arena.reset();
+                allocator = other.allocator;
+            }
+        }
+        EnsureArena();
+        incremental = other.incremental;
+        reserved_id_max_size = other.reserved_id_max_size;
+        if (other.root.stupid) {
             for (const auto& element : other) {
                 insert(element);
             }
             return *this;
         }
-        stupid = false;
-        hasher = other.hasher;
-        id_max_size = other.id_max_size;
-        max_size = other.max_size;
-        data = std::vector<std::unique_ptr<HashMap>>(max_size);
+        root.BecomeInner();
+        root.id_max_size = other.root.id_max_size;
+        root.ResetCells();
         for (const auto& element : other) {
             insert(element);
         }
         return *this;
     }
 
-private:
-    Hash hasher;
-    uint8_t recursive_level;
-    uint8_t id_max_size;
-    size_t number_of_elements;
-    bool stupid;
-    size_t from_index;
-    HashMap* parent;
-    size_t open_cells;
-    size_t increase; // prime, hash -> hash * increase
-    size_t max_size; // prime, num of cells for elements
+    HashMap& operator=(HashMap&& other) noexcept(std::is_nothrow_move_assignable<Hash>::value &&
+                                                 std::is_nothrow_move_assignable<KeyEqual>::value &&
+                                                 (AllocatorTraits::propagate_on_container_move_assignment::value ||
+                                                  AllocatorTraits::is_always_equal::value)) {
+        if (&other == this) {
+            return *this;
+        }
+        if constexpr (!AllocatorTraits::propagate_on_container_move_assignment::value) {
+            if (allocator != other.allocator) {
+                // the tree lives in memory of another allocator, only the elements can move
+                clear();
+                hasher = std::move(other.hasher);
+                key_equal = std::move(other.key_equal);
+                incremental = other.incremental;
+                for (auto& element : other) {
+                    TryEmplace(hasher(element.first), MovableKey(element), std::move(element.second));
+                }
+                other.clear();
+                return *this;
+            }
+        }
+        if (!own_arena || !TRIVIAL_TEARDOWN) {
+            DeleteTree();
+        }
+        DropNextCells();
+        hasher = std::move(other.hasher);
+        key_equal = std::move(other.key_equal);
+        old_id_max_size = other.old_id_max_size;
+        reserved_id_max_size = other.reserved_id_max_size;
+        seed = other.seed;
+        incremental = other.incremental;
+        migrated = other.migrated;
+        next_id_max_size = other.next_id_max_size;
+        next_cells = other.next_cells;
+        other.next_cells = nullptr;
+        root.id_max_size = other.root.id_max_size;
+        root.number_of_elements = other.root.number_of_elements;
+        root.TakeVectors(other.root);
+        root.old_data = std::move(other.root.old_data);
+        root.old_occupied = std::move(other.root.old_occupied);
+        own_arena = std::move(other.own_arena);
+        if constexpr (AllocatorTraits::propagate_on_container_move_assignment::value) {
+            allocator = other.allocator;
+        }
+        AdoptChildren();
+        other.DropArena();
+        other.clear();
+        return *this;
+    }
 
 private:
-    std::vector<std::pair<const KeyType, ValueType>> small_data;
-    std::vector<std::unique_ptr<HashMap<KeyType, ValueType, Hash>>> data;
+    Hash hasher;
+    KeyEqual key_equal;
+    uint8_t old_id_max_size; // size id of old_data while migrating
+    uint8_t reserved_id_max_size; // reserve(): Reduce keeps the root at least this big
+    uint8_t next_id_max_size; // size id of next_cells
+    uint64_t seed; // of the whole tree, see CellOf
+    bool incremental; // resize the root by migrating cells of old_data
+    size_t migrated; // old_data cells before it are already moved to data
+    NodeVector* next_cells; // cells of the next root size being zeroed before the migration, in the arena
+    Allocator allocator;
+    // nodes and leaf storage of the whole tree, declared before everything allocated from it
+    std::unique_ptr<Arena, typename Arena::Deleter> own_arena;
+    Root root;
 };
+
+namespace pmr {
+    // maps placed in a std::pmr::memory_resource, e.g. a per-request monotonic buffer
+    template<typename KeyType, typename ValueType, typename Hash = std::hash<KeyType>,
+            typename KeyEqual = std::equal_to<KeyType>, typename Policy = DefaultPolicy>
+    using HashMap = ::HashMap<KeyType, ValueType, Hash, KeyEqual,
+                              std::pmr::polymorphic_allocator<std::pair<const KeyType, ValueType>>, Policy>;
+}
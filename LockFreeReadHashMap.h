@@ -0,0 +1,602 @@
+//
+// Recursive hash map whose readers take no locks: copy-on-write leaves and epoch-based reclamation
+//
+#pragma once
+
+#include "ConcurrentHashMap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+const uint8_t COW_LEAF_SIZE = 8; // LockFreeReadHashMap: larger leaves (but on the last level) become inner nodes
+const size_t RETIRED_PER_COLLECT = 64; // epoch::Domain: retired objects between two reclamation attempts
+
+namespace epoch {
+    // A pinned thread may read everything that was reachable when it pinned. An object retired in epoch e
+    // is freed once the global epoch reaches e + 2, and the epoch only advances when every pinned thread
+    // has seen the current one, so no pinned thread can still hold a pointer to it. Every thread keeps
+    // the objects it retired in its own list and frees them itself, no lock is taken on the way.
+    class Domain {
+        struct Retired {
+            void* pointer;
+            void (*deleter)(void*);
+            uint64_t epoch;
+        };
+
+        struct Record {
+            std::atomic<uint64_t> state{0}; // epoch << 1 | 1 while pinned, 0 otherwise
+            std::atomic<bool> used{true};
+            uint32_t depth = 0; // nested guards, only touched by the owning thread
+            std::vector<Retired> retired; // only touched by the owning thread, kept for the next one
+            std::atomic<size_t> retired_count{0};
+            Record* next = nullptr;
+        };
+
+        // gives the record back when its thread exits
+        struct Holder {
+            Record* record;
+            explicit Holder(Domain& domain) : record(domain.Acquire()) {}
+            ~Holder() {
+                record->used.store(false, std::memory_order_release);
+            }
+        };
+
+    public:
+        class Guard {
+        public:
+            explicit Guard(Record* record) : record(record) {}
+            Guard(const Guard&) = delete;
+            Guard& operator=(const Guard&) = delete;
+            ~Guard() {
+                if (--record->depth == 0) {
+                    record->state.store(0, std::memory_order_release);
+                }
+            }
+
+        private:
+            Record* record;
+        };
+
+        static Domain& Global() {
+            static Domain domain;
+            return domain;
+        }
+
+        Guard Pin() {
+            Record* record = LocalRecord();
+            if (record->depth++ == 0) {
+                // a release as well: the reclaimer that sees the new state also sees the end of the previous pin
+                record->state.store(epoch.load(std::memory_order_acquire) << 1 | 1, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+            return Guard(record);
+        }
+
+        // pointer must already be unreachable for threads that pin from now on
+        void Retire(void* pointer, void (*deleter)(void*)) {
+            Record* record = LocalRecord();
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            record->retired.push_back({pointer, deleter, epoch.load(std::memory_order_relaxed)});
+            record->retired_count.store(record->retired.size(), std::memory_order_relaxed);
+            if (record->retired.size() % RETIRED_PER_COLLECT == 0) {
+                TryAdvance();
+                Collect(record);
+            }
+        }
+
+        // frees whatever no pinned thread can see any more, e.g. after the writers stopped: the objects
+        // this thread retired and the ones left behind by threads that exited
+        void Reclaim() {
+            TryAdvance();
+            TryAdvance();
+            Record* own = LocalRecord();
+            for (Record* record = records.load(std::memory_order_acquire); record; record = record->next) {
+                bool expected = false;
+                if (record == own) {
+                    Collect(record);
+                } else if (record->used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    Collect(record);
+                    record->used.store(false, std::memory_order_release);
+                }
+            }
+        }
+
+        size_t retired_size() const {
+            size_t size = 0;
+            for (Record* record = records.load(std::memory_order_acquire); record; record = record->next) {
+                size += record->retired_count.load(std::memory_order_relaxed);
+            }
+            return size;
+        }
+
+        ~Domain() {
+            for (Record* record = records.load(); record;) {
+                for (auto& item : record->retired) {
+                    item.deleter(item.pointer);
+                }
+                Record* next = record->next;
+                delete record;
+                record = next;
+            }
+        }
+
+    private:
+        Domain() = default;
+
+        Record* LocalRecord() {
+            thread_local Holder holder(*this);
+            return holder.record;
+        }
+
+        Record* Acquire() {
+            for (Record* record = records.load(std::memory_order_acquire); record; record = record->next) {
+                bool expected = false;
+                if (record->used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    return record;
+                }
+            }
+            Record* record = new Record();
+            record->next = records.load(std::memory_order_relaxed);
+            while (!records.compare_exchange_weak(record->next, record, std::memory_order_release,
+                                                  std::memory_order_relaxed)) {}
+            return record;
+        }
+
+        // any thread may try, only one of those that saw the same epoch moves it
+        bool TryAdvance() {
+            uint64_t global = epoch.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (Record* record = records.load(std::memory_order_acquire); record; record = record->next) {
+                uint64_t state = record->state.load(std::memory_order_acquire);
+                if ((state & 1) && (state >> 1) != global) {
+                    return false;
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return epoch.compare_exchange_strong(global, global + 1, std::memory_order_acq_rel,
+                                                 std::memory_order_relaxed);
+        }
+
+        // called by the thread that holds the record
+        void Collect(Record* record) {
+            uint64_t global = epoch.load(std::memory_order_acquire);
+            std::vector<Retired>& retired = record->retired;
+            size_t kept = 0;
+            for (size_t i = 0; i < retired.size(); ++i) {
+                if (retired[i].epoch + 2 <= global) {
+                    retired[i].deleter(retired[i].pointer);
+                } else {
+                    retired[kept++] = retired[i];
+                }
+            }
+            retired.resize(kept);
+            record->retired_count.store(kept, std::memory_order_relaxed);
+        }
+
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<Record*> records{nullptr};
+    };
+}
+
+// The root is a fixed array of stripes like in ConcurrentHashMap, and writers still lock their stripe.
+// Below it the recursive tree is made of inner nodes, whose cells are atomic pointers, and leaves,
+// which never change once published: a write builds a modified copy of the leaf (or of a whole subtree
+// when an inner node grows or shrinks), publishes it with a release store into the cell and retires
+// the old nodes to epoch::Domain. find/at/contains/cvisit only pin the epoch, so they take no locks and
+// never see freed memory. Keys and values have to be copy-constructible. The depth, the cell counts and
+// the seeding of the cells come from Policy as for HashMap, the leaves are bounded by COW_LEAF_SIZE.
+template<typename KeyType, typename ValueType,
+        typename Hash = std::hash<KeyType>,
+        typename KeyEqual = std::equal_to<KeyType>,
+        typename Policy = DefaultPolicy>
+class LockFreeReadHashMap {
+    using Element = std::pair<const KeyType, ValueType>;
+
+    struct Node {
+        bool leaf;
+        uint8_t recursive_level;
+    };
+
+    struct Leaf : Node {
+        std::vector<Element> elements;
+        std::vector<uint8_t> tags; // padded like the tags of HashMap leaves
+    };
+
+    struct Inner : Node {
+        uint8_t id_max_size;
+        size_t number_of_elements; // only used by the writer of the stripe
+        std::unique_ptr<std::atomic<Node*>[]> cells;
+    };
+
+    struct alignas(64) Stripe {
+        std::mutex writer;
+        std::atomic<Node*> root{nullptr};
+        std::atomic<size_t> size{0};
+    };
+
+    // the way down to a leaf: the inner nodes and the cells that hold them
+    struct Path {
+        Inner* nodes[Policy::MAX_RECURSIVE_LEVEL];
+        std::atomic<Node*>* cells[Policy::MAX_RECURSIVE_LEVEL + 1];
+        uint8_t depth = 0;
+    };
+
+public:
+    explicit LockFreeReadHashMap(size_t stripes = DEFAULT_STRIPES, const Hash& hash = Hash(),
+                                 const KeyEqual& equal = KeyEqual()) :
+            hasher(hash), key_equal(equal), seed(Policy::SEEDED_HASH ? NewSeed() : 0) {
+        while ((size_t(1) << stripe_bits) < stripes) {
+            ++stripe_bits;
+        }
+        stripes_data.reset(new Stripe[stripe_count()]);
+    }
+
+    LockFreeReadHashMap(const LockFreeReadHashMap&) = delete;
+    LockFreeReadHashMap& operator=(const LockFreeReadHashMap&) = delete;
+
+    // no thread may use the map any more
+    ~LockFreeReadHashMap() {
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            DeleteTree(stripes_data[i].root.load(std::memory_order_relaxed));
+        }
+    }
+
+    size_t stripe_count() const {
+        return size_t(1) << stripe_bits;
+    }
+
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+    // f(const ValueType&) runs while the epoch is pinned; false if the key is absent
+    template<class F>
+    bool cvisit(const KeyType& key, F f) const {
+        size_t hash = hasher(key);
+        auto guard = epoch::Domain::Global().Pin();
+        const Node* node = stripes_data[StripeIndex(hash, stripe_bits)].root.load(std::memory_order_acquire);
+        while (node && !node->leaf) {
+            const Inner* inner = static_cast<const Inner*>(node);
+            node = inner->cells[GetPos(hash, inner)].load(std::memory_order_acquire);
+        }
+        if (!node) {
+            return false;
+        }
+        const Leaf* leaf = static_cast<const Leaf*>(node);
+        size_t i = FindInLeaf(leaf, key, hash);
+        if (i == leaf->elements.size()) {
+            return false;
+        }
+        f(leaf->elements[i].second);
+        return true;
+    }
+
+    // copies the value out of the leaf while the pin keeps it alive; false if the key is absent
+    bool find(const KeyType& key, ValueType& value) const {
+        return cvisit(key, [&](const ValueType& found) {
+            value = found;
+        });
+    }
+
+    bool contains(const KeyType& key) const {
+        return cvisit(key, [](const ValueType&) {});
+    }
+
+    size_t count(const KeyType& key) const {
+        return contains(key) ? 1 : 0;
+    }
+
+    ValueType at(const KeyType& key) const {
+        std::optional<ValueType> value;
+        if (!cvisit(key, [&](const ValueType& found) {
+            value.emplace(found);
+        })) {
+            throw std::out_of_range("Out of Range error with at");
+        }
+        return std::move(*value);
+    }
+
+    bool insert(const std::pair<const KeyType, ValueType>& add) {
+        return Write(add.first, add.second, false);
+    }
+
+    // an assignment publishes a copy of the leaf as well, a reader sees either the old or the new value
+    // but never one being written; returns true if inserted, false if assigned
+    bool insert_or_assign(const KeyType& key, const ValueType& value) {
+        return Write(key, value, true);
+    }
+
+    bool erase(const KeyType& key) {
+        size_t hash = hasher(key);
+        Stripe& stripe = stripes_data[StripeIndex(hash, stripe_bits)];
+        std::lock_guard<std::mutex> lock(stripe.writer);
+        Path path;
+        Leaf* leaf = FindLeaf(stripe, hash, path);
+        size_t i = leaf ? FindInLeaf(leaf, key, hash) : 0;
+        if (!leaf || i == leaf->elements.size()) {
+            return false;
+        }
+        Leaf* copy = nullptr;
+        if (leaf->elements.size() > 1) {
+            copy = NewLeaf(leaf->recursive_level, leaf->elements.size() - 1);
+            for (size_t j = 0; j < leaf->elements.size(); ++j) {
+                if (j != i) {
+                    copy->elements.push_back(leaf->elements[j]);
+                    copy->tags.push_back(leaf->tags[j]);
+                }
+            }
+        }
+        Publish(path.cells[path.depth], copy, leaf);
+        stripe.size.fetch_sub(1, std::memory_order_relaxed);
+        for (uint8_t d = 0; d < path.depth; ++d) {
+            Inner* inner = path.nodes[d];
+            if (--inner->number_of_elements <= COW_LEAF_SIZE ||
+                (inner->id_max_size > 0 && inner->number_of_elements * 8 < Cells(inner))) {
+                Rebuild(path.cells[d], inner);
+                break;
+            }
+        }
+        return true;
+    }
+
+    // the counter of a stripe changes right after the publication, so a reader may find an element
+    // that is not counted yet
+    size_t size() const {
+        size_t result = 0;
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            result += stripes_data[i].size.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            Stripe& stripe = stripes_data[i];
+            std::lock_guard<std::mutex> lock(stripe.writer);
+            Node* root = stripe.root.exchange(nullptr, std::memory_order_acq_rel);
+            stripe.size.store(0, std::memory_order_relaxed);
+            if (root) {
+                epoch::Domain::Global().Retire(root, DeleteTreeOf);
+            }
+        }
+    }
+
+    // f(const std::pair<const KeyType, ValueType>&) for every element under a single pin: a leaf never
+    // changes once published, but a write published after the walk passed its cell is not seen
+    template<class F>
+    void for_each(F f) const {
+        auto guard = epoch::Domain::Global().Pin();
+        for (size_t i = 0; i < stripe_count(); ++i) {
+            ForEach(stripes_data[i].root.load(std::memory_order_acquire), f);
+        }
+    }
+
+private:
+    static size_t Cells(const Inner* inner) {
+        return Policy::max_sizes[inner->recursive_level][inner->id_max_size];
+    }
+
+    // the same cell a HashMap with this Policy and seed would choose
+    size_t GetPos(size_t hash, const Inner* inner) const {
+        return CellOf<Policy>(hash, seed, inner->recursive_level, inner->id_max_size);
+    }
+
+    size_t FindInLeaf(const Leaf* leaf, const KeyType& key, size_t hash) const {
+        return simd::FindTag(leaf->tags.data(), leaf->tags.size(), simd::Tag(hash), [&](size_t i) {
+            return key_equal(leaf->elements[i].first, key);
+        });
+    }
+
+    static Leaf* NewLeaf(uint8_t level, size_t size) {
+        Leaf* leaf = new Leaf();
+        leaf->leaf = true;
+        leaf->recursive_level = level;
+        leaf->elements.reserve(size);
+        leaf->tags.reserve(simd::PaddedCapacity<uint8_t>(size));
+        return leaf;
+    }
+
+    // called with the writer lock of the stripe
+    Leaf* FindLeaf(Stripe& stripe, size_t hash, Path& path) const {
+        path.cells[0] = &stripe.root;
+        Node* node = stripe.root.load(std::memory_order_relaxed);
+        while (node && !node->leaf) {
+            Inner* inner = static_cast<Inner*>(node);
+            path.nodes[path.depth] = inner;
+            path.cells[++path.depth] = &inner->cells[GetPos(hash, inner)];
+            node = path.cells[path.depth]->load(std::memory_order_relaxed);
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+    bool Write(const KeyType& key, const ValueType& value, bool assign) {
+        size_t hash = hasher(key);
+        Stripe& stripe = stripes_data[StripeIndex(hash, stripe_bits)];
+        std::lock_guard<std::mutex> lock(stripe.writer);
+        Path path;
+        Leaf* leaf = FindLeaf(stripe, hash, path);
+        size_t size = leaf ? leaf->elements.size() : 0;
+        size_t i = leaf ? FindInLeaf(leaf, key, hash) : 0;
+        if (leaf && i < size) {
+            if (!assign) {
+                return false;
+            }
+            Leaf* copy = NewLeaf(leaf->recursive_level, size);
+            for (size_t j = 0; j < size; ++j) {
+                if (j == i) {
+                    copy->elements.emplace_back(key, value);
+                } else {
+                    copy->elements.push_back(leaf->elements[j]);
+                }
+            }
+            copy->tags.insert(copy->tags.end(), leaf->tags.begin(), leaf->tags.end());
+            Publish(path.cells[path.depth], copy, leaf);
+            return false;
+        }
+        uint8_t level = path.depth == 0 ? 0 : path.nodes[path.depth - 1]->recursive_level + 1;
+        Leaf* copy = NewLeaf(level, size + 1);
+        if (leaf) {
+            // inserted into the reserved vectors, so the tags keep their padding
+            for (const auto& element : leaf->elements) {
+                copy->elements.push_back(element);
+            }
+            copy->tags.insert(copy->tags.end(), leaf->tags.begin(), leaf->tags.end());
+        }
+        copy->elements.emplace_back(key, value);
+        copy->tags.push_back(simd::Tag(hash));
+        Node* published = copy;
+        if (size + 1 > COW_LEAF_SIZE && level + 1 < Policy::MAX_RECURSIVE_LEVEL) {
+            published = Build(ElementsOf(copy), level);
+            delete copy;
+        }
+        Publish(path.cells[path.depth], published, leaf);
+        stripe.size.fetch_add(1, std::memory_order_relaxed);
+        for (uint8_t d = 0; d < path.depth; ++d) {
+            Inner* inner = path.nodes[d];
+            if (++inner->number_of_elements > 2 * Cells(inner) && inner->id_max_size + 1 < Policy::MAX_SIZE_ID) {
+                Rebuild(path.cells[d], inner);
+                break;
+            }
+        }
+        return true;
+    }
+
+    // readers that load the cell from now on see node, the ones that already hold old keep it until they unpin
+    static void Publish(std::atomic<Node*>* cell, Node* node, Leaf* old) {
+        cell->store(node, std::memory_order_release);
+        if (old) {
+            epoch::Domain::Global().Retire(old, [](void* pointer) {
+                delete static_cast<Leaf*>(pointer);
+            });
+        }
+    }
+
+    // replaces the subtree with one sized for its current number of elements
+    void Rebuild(std::atomic<Node*>* cell, Inner* inner) {
+        std::vector<const Element*> elements;
+        elements.reserve(inner->number_of_elements);
+        Collect(inner, elements);
+        cell->store(elements.empty() ? nullptr : Build(elements, inner->recursive_level), std::memory_order_release);
+        epoch::Domain::Global().Retire(inner, DeleteTreeOf);
+    }
+
+    static std::vector<const Element*> ElementsOf(const Leaf* leaf) {
+        std::vector<const Element*> elements;
+        for (const auto& element : leaf->elements) {
+            elements.push_back(&element);
+        }
+        return elements;
+    }
+
+    static void Collect(const Node* node, std::vector<const Element*>& elements) {
+        if (!node) {
+            return;
+        }
+        if (node->leaf) {
+            for (const auto& element : static_cast<const Leaf*>(node)->elements) {
+                elements.push_back(&element);
+            }
+            return;
+        }
+        const Inner* inner = static_cast<const Inner*>(node);
+        for (size_t i = 0; i < Cells(inner); ++i) {
+            Collect(inner->cells[i].load(std::memory_order_relaxed), elements);
+        }
+    }
+
+    // a new unpublished subtree with copies of the elements, about one element per cell
+    Node* Build(const std::vector<const Element*>& elements, uint8_t level) const {
+        if (elements.size() <= COW_LEAF_SIZE || level + 1 == Policy::MAX_RECURSIVE_LEVEL) {
+            Leaf* leaf = NewLeaf(level, elements.size());
+            for (const Element* element : elements) {
+                leaf->elements.push_back(*element);
+                leaf->tags.push_back(simd::Tag(hasher(element->first)));
+            }
+            return leaf;
+        }
+        Inner* inner = new Inner();
+        inner->leaf = false;
+        inner->recursive_level = level;
+        inner->id_max_size = 0;
+        while (Cells(inner) < elements.size() && inner->id_max_size + 1 < Policy::MAX_SIZE_ID) {
+            ++inner->id_max_size;
+        }
+        inner->number_of_elements = elements.size();
+        inner->cells.reset(new std::atomic<Node*>[Cells(inner)]());
+        std::vector<std::pair<size_t, const Element*>> positions;
+        positions.reserve(elements.size());
+        for (const Element* element : elements) {
+            positions.emplace_back(GetPos(hasher(element->first), inner), element);
+        }
+        std::sort(positions.begin(), positions.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+        std::vector<const Element*> cell;
+        for (size_t begin = 0; begin < positions.size();) {
+            size_t end = begin;
+            cell.clear();
+            for (; end < positions.size() && positions[end].first == positions[begin].first; ++end) {
+                cell.push_back(positions[end].second);
+            }
+            inner->cells[positions[begin].first].store(Build(cell, level + 1), std::memory_order_relaxed);
+            begin = end;
+        }
+        return inner;
+    }
+
+    template<class F>
+    static void ForEach(const Node* node, F& f) {
+        if (!node) {
+            return;
+        }
+        if (node->leaf) {
+            for (const auto& element : static_cast<const Leaf*>(node)->elements) {
+                f(element);
+            }
+            return;
+        }
+        const Inner* inner = static_cast<const Inner*>(node);
+        for (size_t i = 0; i < Cells(inner); ++i) {
+            ForEach(inner->cells[i].load(std::memory_order_acquire), f);
+        }
+    }
+
+    static void DeleteTree(Node* node) {
+        if (!node) {
+            return;
+        }
+        if (node->leaf) {
+            delete static_cast<Leaf*>(node);
+            return;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        for (size_t i = 0; i < Cells(inner); ++i) {
+            DeleteTree(inner->cells[i].load(std::memory_order_relaxed));
+        }
+        delete inner;
+    }
+
+    static void DeleteTreeOf(void* pointer) {
+        DeleteTree(static_cast<Node*>(pointer));
+    }
+
+    Hash hasher;
+    KeyEqual key_equal;
+    uint64_t seed; // see CellOf
+    uint8_t stripe_bits = 0;
+    std::unique_ptr<Stripe[]> stripes_data;
+};
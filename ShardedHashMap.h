@@ -0,0 +1,51 @@
+//
+// ConcurrentHashMap with a compile-time number of shards
+//
+#pragma once
+
+#include "ConcurrentHashMap.h"
+
+#include <array>
+#include <vector>
+
+using ShardStats = StripeStats;
+
+// A ConcurrentHashMap with a compile-time number of shards: each shard is a HashMap with its own lock and
+// resize, a key goes to the shard of the top bits of a remix of its hash. The batch operations and the
+// lock stats come from ConcurrentHashMap. Shards has to be a power of two.
+template<typename KeyType, typename ValueType,
+        typename Hash = std::hash<KeyType>,
+        size_t Shards = DEFAULT_STRIPES,
+        typename KeyEqual = std::equal_to<KeyType>,
+        typename Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+        typename Policy = DefaultPolicy>
+class ShardedHashMap : public ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy> {
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "Shards must be a power of two");
+
+    using Base = ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+
+public:
+    explicit ShardedHashMap(const Hash& hash = Hash(), const KeyEqual& equal = KeyEqual(),
+                            const Allocator& alloc = Allocator()) : Base(Shards, hash, equal, alloc) {}
+
+    static constexpr size_t shard_count() {
+        return Shards;
+    }
+
+    size_t shard_of(const KeyType& key) const {
+        return Base::stripe_of(key);
+    }
+
+    std::array<ShardStats, Shards> shard_stats() const {
+        std::vector<StripeStats> stats = Base::stripe_stats();
+        std::array<ShardStats, Shards> result;
+        for (size_t i = 0; i < Shards; ++i) {
+            result[i] = stats[i];
+        }
+        return result;
+    }
+
+    void reset_shard_stats() {
+        Base::reset_stripe_stats();
+    }
+};
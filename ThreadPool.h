@@ -0,0 +1,118 @@
+//
+// Fixed thread pool for the parallel operations of the hash maps
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// threads - 1 workers, the thread that calls ParallelFor works as well. One ParallelFor runs at a time,
+// a task must not start another one on the same pool.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+        for (size_t i = 1; i < threads; ++i) {
+            workers.emplace_back([this] {
+                Work();
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    // f(i) for every i of [0, count), the indices are handed out one by one; returns when all are done
+    // and rethrows the first exception of a task
+    void ParallelFor(size_t count, const std::function<void(size_t)>& f) {
+        std::lock_guard<std::mutex> run_lock(run_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &f;
+            task_count = count;
+            next.store(0);
+            busy = workers.size();
+            error = nullptr;
+            ++generation;
+        }
+        wake.notify_all();
+        RunTasks();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] {
+            return busy == 0;
+        });
+        task = nullptr;
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    void Work() {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] {
+                    return stop || generation != seen;
+                });
+                if (stop) {
+                    return;
+                }
+                seen = generation;
+            }
+            RunTasks();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    void RunTasks() {
+        for (size_t i = next++; i < task_count; i = next++) {
+            try {
+                (*task)(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)>* task = nullptr;
+    size_t task_count = 0;
+    std::atomic<size_t> next{0};
+    size_t busy = 0;
+    size_t generation = 0;
+    bool stop = false;
+    std::exception_ptr error;
+};
@@ -0,0 +1,1192 @@
+#include "HashMap.h"
+#include "ConcurrentHashMap.h"
+#include "LockFreeReadHashMap.h"
+#include "ShardedHashMap.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/resource.h>
+
+/* probe type: counts every copy and move of keys/values stored in the map */
+struct CountingInt {
+    int x;
+    static size_t copies;
+    static size_t moves;
+    CountingInt() : x(0) {}
+    CountingInt(int x) : x(x) {}
+    CountingInt(const CountingInt& rs) : x(rs.x) {
+        ++copies;
+    }
+    CountingInt(CountingInt&& rs) noexcept : x(rs.x) {
+        ++moves;
+    }
+    CountingInt& operator=(const CountingInt& rs) {
+        x = rs.x;
+        ++copies;
+        return *this;
+    }
+    CountingInt& operator=(CountingInt&& rs) noexcept {
+        x = rs.x;
+        ++moves;
+        return *this;
+    }
+    bool operator==(const CountingInt& rs) const {
+        return x == rs.x;
+    }
+    bool operator!=(const CountingInt& rs) const {
+        return x != rs.x;
+    }
+
+    static void init() {
+        copies = 0;
+        moves = 0;
+    }
+};
+size_t CountingInt::copies;
+size_t CountingInt::moves;
+
+/* probe type: counts full key comparisons */
+struct ComparedString {
+    std::string s;
+    static size_t comparisons;
+    bool operator==(const ComparedString& rs) const {
+        ++comparisons;
+        return s == rs.s;
+    }
+};
+size_t ComparedString::comparisons;
+
+namespace std {
+    template<> struct hash<CountingInt> {
+        size_t operator()(const CountingInt& x) const {
+            return x.x;
+        }
+    };
+    template<> struct hash<ComparedString> {
+        size_t operator()(const ComparedString& x) const {
+            return hash<string>()(x.s);
+        }
+    };
+}
+
+namespace benchmarks {
+
+    using Clock = std::chrono::steady_clock;
+
+    double MillisecondsSince(Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    void Report(const std::string& name, size_t n, Clock::time_point start) {
+        double ms = MillisecondsSince(start);
+        std::cout << "  " << name << ": n=" << n << " time=" << ms << "ms"
+                  << " copies=" << CountingInt::copies << " moves=" << CountingInt::moves
+                  << " copies/elem=" << static_cast<double>(CountingInt::copies) / n << "\n";
+    }
+
+    HashMap<CountingInt, CountingInt> MakeMap(int n) {
+        HashMap<CountingInt, CountingInt> map;
+        for (int i = 0; i < n; ++i) {
+            map.try_emplace(CountingInt(i), i);
+        }
+        return map;
+    }
+
+/* count key/value copies done by the different ways of filling and passing a map */
+    void copy_count() {
+        std::cout << "copy_count\n";
+        const int n = 100000;
+        {
+            HashMap<CountingInt, CountingInt> map;
+            CountingInt::init();
+            auto start = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                map.insert(std::make_pair(CountingInt(i), CountingInt(i)));
+            }
+            Report("insert(rvalue pair)", n, start);
+        }
+        {
+            HashMap<CountingInt, CountingInt> map;
+            CountingInt::init();
+            auto start = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                map.emplace(i, i);
+            }
+            Report("emplace(args)", n, start);
+        }
+        {
+            HashMap<CountingInt, CountingInt> map;
+            CountingInt::init();
+            auto start = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                map.try_emplace(CountingInt(i), i);
+            }
+            Report("try_emplace", n, start);
+        }
+        {
+            HashMap<CountingInt, CountingInt> map = MakeMap(n);
+            CountingInt::init();
+            auto start = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                map.insert_or_assign(CountingInt(i), CountingInt(i + 1));
+            }
+            Report("insert_or_assign(existing)", n, start);
+        }
+        {
+            HashMap<CountingInt, CountingInt> source = MakeMap(n);
+            CountingInt::init();
+            auto start = Clock::now();
+            std::vector<HashMap<CountingInt, CountingInt>> maps;
+            maps.push_back(std::move(source));
+            HashMap<CountingInt, CountingInt> moved(std::move(maps.back()));
+            maps.back() = std::move(moved);
+            Report("move ctor/assignment", n, start);
+        }
+        {
+            HashMap<CountingInt, CountingInt> source = MakeMap(n);
+            CountingInt::init();
+            auto start = Clock::now();
+            HashMap<CountingInt, CountingInt> copy(source);
+            Report("copy ctor (reference)", n, start);
+        }
+    }
+
+    size_t PeakRssKb() {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<size_t>(usage.ru_maxrss);
+    }
+
+/* p99 and worst single insert (the root resize stall) and peak RSS while growing to 3M entries, with and
+ * without incremental resize; run it alone, peak RSS is per process */
+    void resize_stall() {
+        std::cout << "resize_stall\n";
+        const int n = 3000000;
+        for (bool incremental : {false, true}) {
+            HashMap<int, int> map;
+            map.set_incremental_resize(incremental);
+            std::vector<double> latencies(n);
+            double worst = 0;
+            size_t worst_size = 0;
+            size_t worst_rss_growth = 0;
+            srand(1);
+            auto total = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                int key = rand();
+                size_t rss = PeakRssKb();
+                auto start = Clock::now();
+                map.insert({key, i});
+                double ms = MillisecondsSince(start);
+                latencies[i] = ms;
+                if (ms > worst) {
+                    worst = ms;
+                    worst_size = map.size();
+                    worst_rss_growth = PeakRssKb() - rss;
+                }
+            }
+            double total_ms = MillisecondsSince(total);
+            std::nth_element(latencies.begin(), latencies.begin() + n / 100 * 99, latencies.end());
+            std::cout << "  " << (incremental ? "incremental" : "stop-the-world") << " insert: n=" << n
+                      << " total=" << total_ms << "ms p99=" << latencies[n / 100 * 99] * 1000 << "us"
+                      << " worst=" << worst << "ms at size " << worst_size
+                      << " peak_rss_growth_during_worst=" << worst_rss_growth / 1024 << "MB"
+                      << " peak_rss=" << PeakRssKb() / 1024 << "MB\n";
+        }
+        CountingInt::init();
+        auto start = Clock::now();
+        {
+            HashMap<CountingInt, CountingInt> counted = MakeMap(n);
+            Report("copies while growing", n, start);
+        }
+    }
+
+/* insert latency percentiles with and without incremental resize */
+    void insert_latency() {
+        std::cout << "insert_latency\n";
+        const int n = 3000000;
+        for (bool incremental : {false, true}) {
+            HashMap<int, int> map;
+            map.set_incremental_resize(incremental);
+            std::vector<double> latencies(n);
+            srand(1);
+            auto total = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                int key = rand();
+                auto start = Clock::now();
+                map.insert({key, i});
+                latencies[i] = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+            }
+            double total_ms = MillisecondsSince(total);
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&](double p) {
+                return latencies[static_cast<size_t>(p * (n - 1))];
+            };
+            std::cout << "  " << (incremental ? "incremental" : "stop-the-world") << ": n=" << n
+                      << " total=" << total_ms << "ms p50=" << percentile(0.5) << "us"
+                      << " p99=" << percentile(0.99) << "us p999=" << percentile(0.999) << "us"
+                      << " p9999=" << percentile(0.9999) << "us max=" << latencies.back() << "us\n";
+        }
+    }
+
+/* memory resource that counts the allocations passed to the heap */
+    class CallCountingResource : public std::pmr::memory_resource {
+    public:
+        size_t calls = 0;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            ++calls;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override {
+            std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+/* heap allocations and throughput of the random insert/erase workload from main.cpp */
+    void allocator_calls() {
+        std::cout << "allocator_calls\n";
+        const int T = (int)1e7;
+        const int operations = (int)1e6;
+        srand(1);
+        CallCountingResource heap;
+        auto start = Clock::now();
+        {
+            pmr::HashMap<int, int> map(&heap);
+            for (int iq = 0; iq < operations; ++iq) {
+                int t = rand() % 3;
+                if (t == 0) {
+                    int x = rand() % T, y = rand();
+                    map[x] = y;
+                } else if (t == 1) {
+                    map.erase(rand() % T);
+                } else {
+                    map.find(rand() % T);
+                }
+            }
+            std::cout << "  random workload: operations=" << operations << " size=" << map.size()
+                      << " time=" << MillisecondsSince(start) << "ms"
+                      << " allocator_calls=" << heap.calls;
+            start = Clock::now();
+        }
+        std::cout << " destruction=" << MillisecondsSince(start) << "ms\n";
+    }
+
+/* short-lived per-request maps: straight from the heap vs in a monotonic buffer on top of it */
+    void pmr_requests() {
+        std::cout << "pmr_requests\n";
+        const int requests = 20000;
+        const int elements = 1000;
+        size_t checksum = 0;
+        CallCountingResource heap;
+        auto start = Clock::now();
+        for (int request = 0; request < requests; ++request) {
+            pmr::HashMap<int, int> map(&heap);
+            for (int i = 0; i < elements; ++i) {
+                map[i * 7919 + request] = i;
+            }
+            checksum += map.size();
+        }
+        std::cout << "  heap: requests=" << requests << " elements=" << elements
+                  << " time=" << MillisecondsSince(start) << "ms"
+                  << " allocator_calls=" << heap.calls << "\n";
+        std::vector<char> buffer(1 << 20);
+        heap.calls = 0;
+        start = Clock::now();
+        for (int request = 0; request < requests; ++request) {
+            std::pmr::monotonic_buffer_resource resource(buffer.data(), buffer.size(), &heap);
+            pmr::HashMap<int, int> map(&resource);
+            for (int i = 0; i < elements; ++i) {
+                map[i * 7919 + request] = i;
+            }
+            checksum += map.size();
+        }
+        std::cout << "  monotonic pmr: requests=" << requests << " elements=" << elements
+                  << " time=" << MillisecondsSince(start) << "ms"
+                  << " allocator_calls=" << heap.calls << " (" << checksum << ")\n";
+    }
+
+/* lookups that end in a leaf scan: small maps, the default map and a deep leaf built
+ * by a weak hash (every key collides on every level) */
+    template<class KeyType>
+    void LeafFind(const std::string& name) {
+        const int lookups = 20000000;
+        size_t found = 0;
+        {
+            std::vector<HashMap<KeyType, int>> maps(1000);
+            for (size_t m = 0; m < maps.size(); ++m) {
+                for (int i = 0; i < 3; ++i) {
+                    maps[m][static_cast<KeyType>(m * 3 + i)] = i;
+                }
+            }
+            auto start = Clock::now();
+            for (int i = 0; i < lookups; ++i) {
+                found += maps[i % maps.size()].find(static_cast<KeyType>(i % 4000)) != maps[i % maps.size()].end();
+            }
+            std::cout << "  " << name << " small maps: lookups=" << lookups << " time=" << MillisecondsSince(start) << "ms\n";
+        }
+        {
+            HashMap<KeyType, int> map;
+            std::vector<KeyType> keys;
+            for (int i = 0; i < 1000000; ++i) {
+                map[static_cast<KeyType>(i) * 2039] = i;
+                keys.push_back(static_cast<KeyType>(i) * 2039 + i % 2);
+            }
+            // sequential keys would walk the cells with a constant stride
+            std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+            auto start = Clock::now();
+            for (int i = 0; i < lookups; ++i) {
+                found += map.find(keys[i % keys.size()]) != map.end();
+            }
+            std::cout << "  " << name << " 1M map: lookups=" << lookups << " time=" << MillisecondsSince(start) << "ms\n";
+        }
+        {
+            auto weak_hash = [](KeyType x) -> size_t {
+                return static_cast<size_t>(x) % 2;
+            };
+            HashMap<KeyType, int, decltype(weak_hash)> map(weak_hash);
+            for (int i = 0; i < 256; ++i) {
+                map[static_cast<KeyType>(i) * 2] = i;
+            }
+            auto start = Clock::now();
+            for (int i = 0; i < lookups / 10; ++i) {
+                found += map.find(static_cast<KeyType>(i % 512)) != map.end();
+            }
+            std::cout << "  " << name << " 256-key leaf: lookups=" << lookups / 10 << " time=" << MillisecondsSince(start)
+                      << "ms (" << found << ")\n";
+        }
+    }
+
+    void leaf_find() {
+        std::cout << "leaf_find\n";
+        LeafFind<int>("int");
+        LeafFind<long long>("long long");
+    }
+
+/* full key comparisons per string lookup, hits and misses, in one big map and in many small ones */
+    void string_find() {
+        std::cout << "string_find\n";
+        const int n = 1000000;
+        const int lookups = 2000000;
+        std::vector<ComparedString> keys;
+        for (int i = 0; i < 2 * n; ++i) {
+            keys.push_back({"key number " + std::to_string(i) + " with a long common prefix"});
+        }
+        HashMap<ComparedString, int> map;
+        std::vector<HashMap<ComparedString, int>> small_maps(n / 3);
+        for (int i = 0; i < n; ++i) {
+            map[keys[i]] = i;
+            small_maps[i % small_maps.size()][keys[i]] = i;
+        }
+        for (bool small : {false, true}) {
+            for (bool hit : {true, false}) {
+                ComparedString::comparisons = 0;
+                size_t found = 0;
+                auto start = Clock::now();
+                for (int i = 0; i < lookups; ++i) {
+                    const auto& key = keys[i % n + (hit ? 0 : n)];
+                    const auto& target = small ? small_maps[i % n % small_maps.size()] : map;
+                    found += target.find(key) != target.end();
+                }
+                std::cout << "  " << (small ? "3-element maps" : "1M map") << (hit ? " hits" : " misses")
+                          << ": lookups=" << lookups << " time=" << MillisecondsSince(start) << "ms"
+                          << " comparisons/lookup=" << static_cast<double>(ComparedString::comparisons) / lookups
+                          << " (" << found << ")\n";
+            }
+        }
+    }
+
+/* std::string keys, where hashing dominates: time and hash calls per operation */
+    struct CountingStringHash {
+        static size_t calls;
+        size_t operator()(const std::string& s) const {
+            ++calls;
+            return std::hash<std::string>()(s);
+        }
+    };
+    size_t CountingStringHash::calls;
+
+    void string_keys() {
+        std::cout << "string_keys\n";
+        const int n = 1000000;
+        std::vector<std::string> keys;
+        for (int i = 0; i < 2 * n; ++i) {
+            keys.push_back("/usr/share/items/" + std::to_string(i * 7919LL) + "/value.txt");
+        }
+        HashMap<std::string, int, CountingStringHash> map;
+        auto report = [&](const std::string& name, int operations, Clock::time_point start) {
+            std::cout << "  " << name << ": operations=" << operations << " time=" << MillisecondsSince(start) << "ms"
+                      << " hashes/operation=" << static_cast<double>(CountingStringHash::calls) / operations << "\n";
+            CountingStringHash::calls = 0;
+        };
+        CountingStringHash::calls = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < n; ++i) {
+            map[keys[i]] = i;
+        }
+        report("operator[] (insert)", n, start);
+        size_t found = 0;
+        start = Clock::now();
+        for (int i = 0; i < 2 * n; ++i) {
+            found += map.find(keys[i]) != map.end();
+        }
+        report("find (half hits)", 2 * n, start);
+        start = Clock::now();
+        for (int i = 0; i < n; ++i) {
+            found += map.erase(keys[i]);
+        }
+        report("erase", n, start);
+        std::cout << "  (" << found << ")\n";
+    }
+
+/* check-then-insert deduplication of string keys: each call hashes the key vs one hash_of per key
+ * passed to both contains and insert (relocations while the nodes grow hash the rest) */
+    void precomputed_hash() {
+        std::cout << "precomputed_hash\n";
+        const int n = 1000000;
+        std::vector<std::string> keys;
+        for (int i = 0; i < n; ++i) {
+            keys.push_back("/usr/share/items/" + std::to_string(i % (n / 2) * 7919LL) + "/value.txt");
+        }
+        for (bool precomputed : {false, true}) {
+            HashMap<std::string, int, CountingStringHash> map;
+            CountingStringHash::calls = 0;
+            size_t unique = 0;
+            auto start = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                if (precomputed) {
+                    size_t hash = map.hash_of(keys[i]);
+                    if (!map.contains(keys[i], hash)) {
+                        unique += map.insert({keys[i], i}, hash);
+                    }
+                } else if (!map.contains(keys[i])) {
+                    unique += map.insert({keys[i], i});
+                }
+            }
+            std::cout << "  " << (precomputed ? "hash_of + precomputed overloads" : "contains + insert")
+                      << ": time=" << MillisecondsSince(start) << "ms"
+                      << " hashes/key=" << static_cast<double>(CountingStringHash::calls) / n
+                      << " (" << unique << ")\n";
+        }
+    }
+
+/* random lookups in a map much larger than the caches: one find at a time vs find_batch */
+    void find_batch() {
+        std::cout << "find_batch\n";
+        const int n = 4000000;
+        const int lookups = 4000000;
+        HashMap<long long, int> map;
+        for (int i = 0; i < n; ++i) {
+            map[i * 7919LL] = i;
+        }
+        std::vector<long long> keys(lookups);
+        std::mt19937 random(1);
+        for (auto& key : keys) {
+            key = random() % (2 * n) * 7919LL;
+        }
+        size_t found = 0;
+        auto start = Clock::now();
+        for (long long key : keys) {
+            found += map.find(key) != map.end();
+        }
+        std::cout << "  find: lookups=" << lookups << " time=" << MillisecondsSince(start) << "ms (" << found << ")\n";
+        std::vector<char> contained(lookups);
+        start = Clock::now();
+        map.contains_batch(keys.begin(), keys.end(), contained.begin());
+        found = std::count(contained.begin(), contained.end(), 1);
+        std::cout << "  contains_batch: lookups=" << lookups << " time=" << MillisecondsSince(start)
+                  << "ms (" << found << ")\n";
+    }
+
+/* a join-style probe stream against maps from 1K to 10M keys (100M does not fit in memory here):
+ * find one key at a time, find_batch groups and find_interleaved with 16 and 32 probes in flight */
+    void probe_stream() {
+        std::cout << "probe_stream\n";
+        const int lookups = 4000000;
+        std::mt19937 random(1);
+        for (int n : {1000, 10000, 100000, 1000000, 10000000}) {
+            HashMap<long long, int> map;
+            for (int i = 0; i < n; ++i) {
+                map[i * 7919LL] = i;
+            }
+            const auto& const_map = map;
+            std::vector<long long> keys(lookups);
+            for (auto& key : keys) {
+                key = random() % (2 * n) * 7919LL;
+            }
+            std::cout << "  " << n << " keys:";
+            size_t found = 0;
+            auto start = Clock::now();
+            for (long long key : keys) {
+                found += map.find(key) != map.end();
+            }
+            std::cout << " find=" << MillisecondsSince(start) << "ms";
+            std::vector<char> contained(lookups);
+            start = Clock::now();
+            map.contains_batch(keys.begin(), keys.end(), contained.begin());
+            std::cout << " contains_batch=" << MillisecondsSince(start) << "ms";
+            for (size_t in_flight : {16, 32}) {
+                size_t interleaved = 0;
+                start = Clock::now();
+                const_map.find_interleaved(keys.begin(), keys.end(), [&](std::vector<long long>::iterator, auto it) {
+                    interleaved += it != const_map.end();
+                }, in_flight);
+                std::cout << " interleaved(" << in_flight << ")=" << MillisecondsSince(start) << "ms";
+                found += interleaved;
+            }
+            std::cout << " (" << found + std::count(contained.begin(), contained.end(), 1) << ")\n";
+        }
+    }
+
+/* shared map throughput, 1 to 64 threads, 50/90/99% reads: one HashMap behind one mutex
+ * vs ConcurrentHashMap; the numbers only mean something with as many cores as threads */
+    template<class Map>
+    double Throughput(Map& map, int threads, int read_percent, int operations, int key_range) {
+        std::vector<std::thread> workers;
+        auto start = Clock::now();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                std::mt19937 random(t + 1);
+                for (int i = 0; i < operations / threads; ++i) {
+                    int key = static_cast<int>(random() % key_range);
+                    int kind = static_cast<int>(random() % 100);
+                    if (kind < read_percent) {
+                        map.contains(key);
+                    } else if (kind % 2 == 0) {
+                        map.insert({key, i});
+                    } else {
+                        map.erase(key);
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        return operations / MillisecondsSince(start) / 1000;
+    }
+
+    struct MutexHashMap {
+        std::mutex mutex;
+        HashMap<int, int> map;
+        bool contains(int key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return map.contains(key);
+        }
+        bool insert(const std::pair<const int, int>& add) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return map.insert(add);
+        }
+        bool erase(int key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return map.erase(key);
+        }
+    };
+
+    void concurrent() {
+        std::cout << "concurrent (Mops/s, hardware threads: " << std::thread::hardware_concurrency() << ")\n";
+        const int operations = 2000000;
+        const int key_range = 1000000;
+        for (int read_percent : {50, 90, 99}) {
+            for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+                MutexHashMap locked;
+                ConcurrentHashMap<int, int> striped;
+                for (int i = 0; i < key_range; i += 2) {
+                    locked.map.insert({i, i});
+                    striped.insert({i, i});
+                }
+                double single = Throughput(locked, threads, read_percent, operations, key_range);
+                double concurrent = Throughput(striped, threads, read_percent, operations, key_range);
+                std::cout << "  reads=" << read_percent << "% threads=" << threads
+                          << ": mutex=" << single << " striped=" << concurrent << "\n";
+            }
+        }
+    }
+
+/* read throughput with one writer running all the time: shared stripe locks vs lock-free readers */
+    template<class Map>
+    double ReadThroughput(Map& map, int readers, int key_range) {
+        const int lookups = 2000000;
+        std::atomic<bool> stop{false};
+        std::thread writer([&] {
+            std::mt19937 random(0);
+            for (int i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+                int key = static_cast<int>(random() % key_range);
+                if (i % 2 == 0) {
+                    map.insert({key, key});
+                } else {
+                    map.erase(key);
+                }
+            }
+        });
+        std::vector<std::thread> workers;
+        std::atomic<size_t> found{0};
+        auto start = Clock::now();
+        for (int t = 0; t < readers; ++t) {
+            workers.emplace_back([&, t] {
+                std::mt19937 random(t + 1);
+                size_t local = 0;
+                for (int i = 0; i < lookups / readers; ++i) {
+                    local += map.contains(static_cast<int>(random() % key_range));
+                }
+                found += local;
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double ms = MillisecondsSince(start);
+        stop.store(true);
+        writer.join();
+        return lookups / ms / 1000;
+    }
+
+    void lock_free_reads() {
+        std::cout << "lock_free_reads (read Mops/s with a concurrent writer, hardware threads: "
+                  << std::thread::hardware_concurrency() << ")\n";
+        const int key_range = 1000000;
+        for (int readers : {1, 2, 4, 8, 16, 32, 64}) {
+            ConcurrentHashMap<int, int> striped;
+            LockFreeReadHashMap<int, int> lock_free;
+            for (int i = 0; i < key_range; i += 2) {
+                striped.insert({i, i});
+                lock_free.insert({i, i});
+            }
+            double locked = ReadThroughput(striped, readers, key_range);
+            double free = ReadThroughput(lock_free, readers, key_range);
+            std::cout << "  readers=" << readers << ": shared_mutex=" << locked << " lock_free=" << free << "\n";
+        }
+    }
+
+/* 4 threads load 1M keys into a ShardedHashMap one by one vs insert_batch of 1000, then the shard stats */
+    void sharded() {
+        std::cout << "sharded\n";
+        const int threads = 4;
+        const int n = 1000000;
+        const int batch = 1000;
+        for (bool batched : {false, true}) {
+            ShardedHashMap<int, int> map;
+            std::vector<std::thread> workers;
+            auto start = Clock::now();
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    std::vector<std::pair<int, int>> elements;
+                    for (int i = t; i < n; i += threads) {
+                        if (!batched) {
+                            map.insert({i, i});
+                            continue;
+                        }
+                        elements.push_back({i, i});
+                        if (elements.size() == batch) {
+                            map.insert_batch(elements.begin(), elements.end());
+                            elements.clear();
+                        }
+                    }
+                    map.insert_batch(elements.begin(), elements.end());
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            double ms = MillisecondsSince(start);
+            auto stats = map.shard_stats();
+            size_t smallest = n, largest = 0, acquisitions = 0, contended = 0;
+            uint64_t longest = 0;
+            for (const auto& shard : stats) {
+                smallest = std::min(smallest, shard.size);
+                largest = std::max(largest, shard.size);
+                acquisitions += shard.lock_acquisitions;
+                contended += shard.contended_acquisitions;
+                longest = std::max(longest, shard.longest_write_ns);
+            }
+            std::cout << "  " << (batched ? "insert_batch" : "insert") << ": time=" << ms << "ms"
+                      << " lock_acquisitions=" << acquisitions << " contended=" << contended
+                      << " shard_size=" << smallest << ".." << largest
+                      << " longest_write=" << longest / 1000 << "us\n";
+        }
+    }
+
+/* building a map from 4M random pairs: the range constructor (one by one inserts) vs the pool build, 1 to 8 threads */
+    void parallel_build() {
+        std::cout << "parallel_build\n";
+        const int n = 4000000;
+        std::vector<std::pair<long long, int>> input(n);
+        std::mt19937_64 random(1);
+        for (int i = 0; i < n; ++i) {
+            input[i] = {static_cast<long long>(random()), i};
+        }
+        auto start = Clock::now();
+        HashMap<long long, int> sequential(input.begin(), input.end());
+        std::cout << "  inserts: time=" << MillisecondsSince(start) << "ms (" << sequential.size() << ")\n";
+        for (size_t threads : {1, 2, 4, 8}) {
+            ThreadPool pool(threads);
+            start = Clock::now();
+            HashMap<long long, int> map(input.begin(), input.end(), pool);
+            std::cout << "  pool of " << threads << ": time=" << MillisecondsSince(start) << "ms (" << map.size() << ")\n";
+        }
+    }
+
+/* a full scan of 4M elements (sum of the values): the iterator vs transform_reduce on 1 to 32 threads */
+    void parallel_scan() {
+        std::cout << "parallel_scan\n";
+        const int n = 4000000;
+        HashMap<long long, long long> map;
+        std::mt19937_64 random(1);
+        for (int i = 0; i < n; ++i) {
+            map[static_cast<long long>(random())] = i;
+        }
+        auto start = Clock::now();
+        long long sum = 0;
+        for (const auto& element : map) {
+            sum += element.second;
+        }
+        std::cout << "  iterator: time=" << MillisecondsSince(start) << "ms (" << sum << ")\n";
+        for (size_t threads : {1, 2, 4, 8, 16, 32}) {
+            ThreadPool pool(threads);
+            start = Clock::now();
+            sum = map.transform_reduce(0ll, std::plus<>(), [](const std::pair<const long long, long long>& element) {
+                return element.second;
+            }, pool);
+            std::cout << "  transform_reduce, " << threads << " threads: time=" << MillisecondsSince(start)
+                      << "ms (" << sum << ")\n";
+        }
+    }
+
+/* inserting N random keys into an empty map vs a map that reserved N first */
+    void reserve() {
+        std::cout << "reserve\n";
+        for (int n : {10000, 100000, 800000}) {
+            std::vector<long long> keys(n);
+            std::mt19937_64 random(n);
+            for (auto& key : keys) {
+                key = static_cast<long long>(random());
+            }
+            for (bool reserved : {false, true}) {
+                auto start = Clock::now();
+                HashMap<long long, int> map;
+                if (reserved) {
+                    map.reserve(n);
+                }
+                for (int i = 0; i < n; ++i) {
+                    map[keys[i]] = i;
+                }
+                std::cout << "  n=" << n << (reserved ? " reserve: " : " no reserve: ") << "time="
+                          << MillisecondsSince(start) << "ms buckets=" << map.bucket_count() << "\n";
+            }
+        }
+    }
+
+/* memory resource that keeps the peak of the bytes in use */
+    class PeakResource : public std::pmr::memory_resource {
+    public:
+        size_t peak = 0;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            in_use += bytes;
+            peak = std::max(peak, in_use);
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override {
+            in_use -= bytes;
+            std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+
+        size_t in_use = 0;
+    };
+
+    template<class Policy>
+    void policy_row(const char* name, const std::vector<long long>& keys, const std::vector<long long>& misses) {
+        PeakResource resource;
+        size_t found = 0;
+        double insert_ms, hit_ms, miss_ms, erase_ms;
+        {
+            pmr::HashMap<long long, int, std::hash<long long>, std::equal_to<long long>, Policy> map(&resource);
+            auto start = Clock::now();
+            for (size_t i = 0; i < keys.size(); ++i) {
+                map[keys[i]] = static_cast<int>(i);
+            }
+            insert_ms = MillisecondsSince(start);
+            start = Clock::now();
+            for (long long key : keys) {
+                found += map.find(key) != map.end();
+            }
+            hit_ms = MillisecondsSince(start);
+            start = Clock::now();
+            for (long long key : misses) {
+                found += map.find(key) != map.end();
+            }
+            miss_ms = MillisecondsSince(start);
+            start = Clock::now();
+            for (long long key : keys) {
+                map.erase(key);
+            }
+            erase_ms = MillisecondsSince(start);
+        }
+        std::cout << "  " << name << ": insert=" << insert_ms << "ms find_hit=" << hit_ms << "ms find_miss="
+                  << miss_ms << "ms erase=" << erase_ms << "ms peak_memory=" << resource.peak / (1 << 20)
+                  << "MB (" << found << ")\n";
+    }
+
+/* the shipped policies side by side: time per phase and peak bytes of the map, 100K and 1M random keys */
+    void policies() {
+        std::cout << "policies\n";
+        for (int n : {100000, 1000000}) {
+            std::vector<long long> keys(n), misses(n);
+            std::mt19937_64 random(n);
+            for (int i = 0; i < n; ++i) {
+                keys[i] = static_cast<long long>(random());
+                misses[i] = static_cast<long long>(random());
+            }
+            std::cout << " n=" << n << "\n";
+            policy_row<DefaultPolicy>("DefaultPolicy", keys, misses);
+            policy_row<LowLatencyPolicy>("LowLatencyPolicy", keys, misses);
+            policy_row<LowMemoryPolicy>("LowMemoryPolicy", keys, misses);
+        }
+    }
+
+    struct FullNodesPolicy : DefaultPolicy {
+        static constexpr size_t COMPACT_MAX_CELLS = 0;
+    };
+
+    struct LowMemoryFullNodesPolicy : LowMemoryPolicy {
+        static constexpr size_t COMPACT_MAX_CELLS = 0;
+    };
+
+/* nodes with a pointer per cell against compact nodes below the root: time per phase and peak bytes,
+ * up to the size where the root stops growing and the elements go down into inner nodes */
+    void compact_nodes() {
+        std::cout << "compact_nodes\n";
+        for (int n : {100000, 1000000, 4000000}) {
+            std::vector<long long> keys(n), misses(n);
+            std::mt19937_64 random(n);
+            for (int i = 0; i < n; ++i) {
+                keys[i] = static_cast<long long>(random());
+                misses[i] = static_cast<long long>(random());
+            }
+            std::cout << " n=" << n << "\n";
+            policy_row<FullNodesPolicy>("full nodes", keys, misses);
+            policy_row<DefaultPolicy>("compact nodes", keys, misses);
+            policy_row<LowMemoryFullNodesPolicy>("LowMemoryPolicy, full nodes", keys, misses);
+            policy_row<LowMemoryPolicy>("LowMemoryPolicy, compact nodes", keys, misses);
+        }
+    }
+
+/* peak bytes per element of the map against std::pmr::unordered_map, both on a PeakResource; the share
+ * of the top level cells (root cells or buckets, a pointer each) is shown apart from the rest */
+    template<class Map>
+    void bytes_row(const char* name, const std::vector<long long>& keys) {
+        PeakResource resource;
+        size_t cells = 0;
+        {
+            Map map(&resource);
+            for (size_t i = 0; i < keys.size(); ++i) {
+                map[keys[i]] = static_cast<int>(i);
+            }
+            cells = map.bucket_count();
+        }
+        std::cout << "  " << name << ": bytes_per_element=" << static_cast<double>(resource.peak) / keys.size()
+                  << " of them cells=" << static_cast<double>(cells * sizeof(void*)) / keys.size() << "\n";
+    }
+
+/* memory of the tree with the shared state and the cell count kept out of the nodes, 100K and 1M random keys */
+    void node_header() {
+        std::cout << "node_header\n";
+        for (int n : {100000, 1000000}) {
+            std::vector<long long> keys(n);
+            std::mt19937_64 random(n);
+            for (int i = 0; i < n; ++i) {
+                keys[i] = static_cast<long long>(random());
+            }
+            std::cout << " n=" << n << "\n";
+            bytes_row<pmr::HashMap<long long, int>>("DefaultPolicy", keys);
+            bytes_row<pmr::HashMap<long long, int, std::hash<long long>, std::equal_to<long long>, LowMemoryPolicy>>(
+                    "LowMemoryPolicy", keys);
+            bytes_row<std::pmr::unordered_map<long long, int>>("std::pmr::unordered_map", keys);
+        }
+    }
+
+/* key without operator<, so its colliding keys stay in an unsorted leaf */
+    struct PlainKey {
+        long long value;
+
+        bool operator==(const PlainKey& other) const {
+            return value == other.value;
+        }
+    };
+
+    template<class Key>
+    void flood_row(const char* name, int n, Key (*make)(long long)) {
+        auto zero_hash = [](const Key&) -> size_t {
+            return 0;
+        };
+        HashMap<Key, int, decltype(zero_hash)> map(zero_hash);
+        std::mt19937_64 random(n);
+        std::vector<Key> keys;
+        for (int i = 0; i < n; ++i) {
+            keys.push_back(make(static_cast<long long>(random() >> 1)));
+        }
+        auto start = Clock::now();
+        for (int i = 0; i < n; ++i) {
+            map.emplace(keys[i], i);
+        }
+        double insert_us = MillisecondsSince(start) * 1000 / n;
+        size_t found = 0;
+        start = Clock::now();
+        for (const Key& key : keys) {
+            found += map.contains(key);
+        }
+        double find_us = MillisecondsSince(start) * 1000 / n;
+        size_t erased = 0;
+        start = Clock::now();
+        for (const Key& key : keys) {
+            erased += map.erase(key);
+        }
+        double erase_us = MillisecondsSince(start) * 1000 / n;
+        std::cout << "  " << name << " n=" << n << ": insert=" << insert_us << "us/op find=" << find_us
+                  << "us/op erase=" << erase_us << "us/op (" << found << ", " << erased << ")\n";
+    }
+
+/* collision flooding: every key hashes to 0 and lands in one last level leaf; the search tree of ordered
+ * keys vs the linear scan left for keys without operator< */
+    void collision_flood() {
+        std::cout << "collision_flood\n";
+        for (int n : {1000, 10000, 50000}) {
+            flood_row<long long>("sorted long long", n, [](long long x) {
+                return x;
+            });
+            flood_row<std::string>("sorted std::string", n, [](long long x) {
+                return std::to_string(x);
+            });
+            flood_row<PlainKey>("unsorted key", n, [](long long x) {
+                return PlainKey{x};
+            });
+        }
+    }
+
+    template<class Policy>
+    void seeded_row(const char* name, const std::vector<long long>& keys, size_t reserve) {
+        HashMap<long long, int, std::hash<long long>, std::equal_to<long long>,
+                std::allocator<std::pair<const long long, int>>, Policy> map;
+        map.reserve(reserve);
+        auto start = Clock::now();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            map[keys[i]] = static_cast<int>(i);
+        }
+        double insert_ms = MillisecondsSince(start);
+        size_t found = 0;
+        start = Clock::now();
+        for (int round = 0; round < 4; ++round) {
+            for (long long key : keys) {
+                found += map.contains(key + round);
+            }
+        }
+        std::cout << "  " << name << ": n=" << keys.size() << " insert=" << insert_ms << "ms find="
+                  << MillisecondsSince(start) << "ms (" << found << ")\n";
+    }
+
+/* cost of the seeded cell mixing on random keys (identity std::hash), and keys prepared to share
+ * one root cell of an unseeded map */
+    void seeded_hash() {
+        std::cout << "seeded_hash\n";
+        std::vector<long long> keys(1000000);
+        std::mt19937_64 random(1);
+        for (auto& key : keys) {
+            key = static_cast<long long>(random() >> 1);
+        }
+        seeded_row<UnseededPolicy>("random keys, unseeded", keys, 0);
+        seeded_row<DefaultPolicy>("random keys, seeded", keys, 0);
+        const size_t n = 20000;
+        HashMap<long long, int, std::hash<long long>, std::equal_to<long long>,
+                std::allocator<std::pair<const long long, int>>, UnseededPolicy> sizing;
+        sizing.reserve(n);
+        uint8_t id = 0;
+        while (max_sizes[id] != sizing.bucket_count()) {
+            ++id;
+        }
+        std::vector<long long> prepared;
+        for (long long x = 0; prepared.size() < n; ++x) {
+            if (ModMaxSize(static_cast<uint32_t>((static_cast<uint64_t>(x) * level_multipliers[0]) >> 32), id) == 0) {
+                prepared.push_back(x);
+            }
+        }
+        seeded_row<UnseededPolicy>("prepared keys, unseeded", prepared, n);
+        seeded_row<DefaultPolicy>("prepared keys, seeded", prepared, n);
+    }
+
+/* full iteration of maps reserved far beyond their size against maps of the same size that grew by themselves,
+ * per element: empty cells are skipped a bitmap word at a time */
+    void sparse_iteration() {
+        std::cout << "sparse_iteration\n";
+        for (size_t n : {1000, 10000, 100000}) {
+            for (size_t reserve : {size_t(0), size_t(4000000)}) {
+                HashMap<int, int> map;
+                map.reserve(reserve);
+                for (size_t i = 0; i < n; ++i) {
+                    map[static_cast<int>(i * 7919)] = static_cast<int>(i);
+                }
+                const size_t rounds = 20000000 / n;
+                long long sum = 0;
+                auto start = Clock::now();
+                for (size_t round = 0; round < rounds; ++round) {
+                    for (const auto& element : map) {
+                        sum += element.second;
+                    }
+                }
+                std::cout << "  n=" << n << " cells=" << map.bucket_count() << ": "
+                          << MillisecondsSince(start) * 1e6 / (rounds * n) << "ns per element (" << sum << ")\n";
+            }
+        }
+    }
+
+/* the cell reduction alone: % by a runtime prime from max_sizes vs ModMaxSize */
+    void get_pos() {
+        std::cout << "get_pos\n";
+        const int n = 1 << 16;
+        const int rounds = 2000;
+        std::vector<uint32_t> values(n);
+        std::vector<uint8_t> ids(n);
+        std::mt19937 random(1);
+        for (int i = 0; i < n; ++i) {
+            values[i] = static_cast<uint32_t>(random());
+            ids[i] = static_cast<uint8_t>(random() % MAX_SIZE_ID);
+        }
+        for (bool fast : {false, true}) {
+            uint64_t checksum = 0;
+            auto start = Clock::now();
+            for (int round = 0; round < rounds; ++round) {
+                for (int i = 0; i < n; ++i) {
+                    checksum += fast ? ModMaxSize(values[i], ids[i]) : values[i] % max_sizes[ids[i]];
+                }
+            }
+            double ms = MillisecondsSince(start);
+            std::cout << "  " << (fast ? "ModMaxSize" : "% max_sizes[id]") << ": reductions=" << 1.0 * n * rounds
+                      << " time=" << ms << "ms ns/reduction=" << ms * 1e6 / (1.0 * n * rounds)
+                      << " (" << checksum << ")\n";
+        }
+    }
+
+/* tokens of a received buffer looked up as they are parsed: a temporary std::string per probe
+ * vs std::string_view with a transparent hash */
+    struct TransparentStringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>()(s);
+        }
+    };
+
+    template<class Map, class MakeKey>
+    void ParseAndLookup(const std::string& name, Map& map, const std::string& buffer,
+                        CallCountingResource& heap, MakeKey make_key) {
+        const int rounds = 20;
+        size_t found = 0;
+        heap.calls = 0;
+        auto start = Clock::now();
+        for (int round = 0; round < rounds; ++round) {
+            size_t begin = 0;
+            while (begin < buffer.size()) {
+                size_t end = buffer.find(' ', begin);
+                found += map.contains(make_key(std::string_view(buffer).substr(begin, end - begin)));
+                begin = end + 1;
+            }
+        }
+        std::cout << "  " << name << ": time=" << MillisecondsSince(start) << "ms"
+                  << " allocator_calls=" << heap.calls << " (" << found << ")\n";
+    }
+
+    void parse_lookup() {
+        std::cout << "parse_lookup\n";
+        const int n = 100000;
+        HashMap<std::pmr::string, int> map;
+        HashMap<std::pmr::string, int, TransparentStringHash, std::equal_to<>> transparent;
+        std::string buffer;
+        for (int i = 0; i < 2 * n; ++i) {
+            std::pmr::string key(("session-" + std::to_string(i * 7919LL) + "-token").c_str());
+            if (i % 2 == 0) {
+                map[key] = i;
+                transparent[key] = i;
+            }
+            buffer += key + ' ';
+        }
+        CallCountingResource heap;
+        ParseAndLookup("std::string temporaries", map, buffer, heap, [&heap](std::string_view token) {
+            return std::pmr::string(token, &heap);
+        });
+        ParseAndLookup("string_view, transparent", transparent, buffer, heap, [](std::string_view token) {
+            return token;
+        });
+    }
+
+    struct Benchmark {
+        const char* name;
+        std::function<void()> run;
+    };
+
+    const std::vector<Benchmark>& All() {
+        static const std::vector<Benchmark> all{
+                {"copy_count", copy_count},
+                {"resize_stall", resize_stall},
+                {"insert_latency", insert_latency},
+                {"allocator_calls", allocator_calls},
+                {"pmr_requests", pmr_requests},
+                {"leaf_find", leaf_find},
+                {"string_find", string_find},
+                {"string_keys", string_keys},
+                {"get_pos", get_pos},
+                {"parse_lookup", parse_lookup},
+                {"precomputed_hash", precomputed_hash},
+                {"find_batch", find_batch},
+                {"probe_stream", probe_stream},
+                {"concurrent", concurrent},
+                {"lock_free_reads", lock_free_reads},
+                {"sharded", sharded},
+                {"parallel_build", parallel_build},
+                {"parallel_scan", parallel_scan},
+                {"reserve", reserve},
+                {"policies", policies},
+                {"compact_nodes", compact_nodes},
+                {"node_header", node_header},
+                {"collision_flood", collision_flood},
+                {"seeded_hash", seeded_hash},
+                {"sparse_iteration", sparse_iteration},
+        };
+        return all;
+    }
+} // namespace benchmarks
+
+/* usage: HashMapBenchmark [name...], runs everything without arguments */
+int main(int argc, char** argv) {
+    for (const auto& benchmark : benchmarks::All()) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; ++i) {
+            if (benchmark.name == std::string(argv[i])) {
+                selected = true;
+            }
+        }
+        if (selected) {
+            benchmark.run();
+        }
+    }
+    return 0;
+}
@@ -1,9 +1,20 @@
 #include "HashMap.h"
+#include "ConcurrentHashMap.h"
+#include "LockFreeReadHashMap.h"
+#include "ShardedHashMap.h"
 #include <iostream>
+#include <atomic>
+#include <cctype>
 #include <cstdlib>
 #include <functional>
 #include <stdexcept>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <thread>
 
 void fail(const char *message) {
     std::cerr << "Fail:\n";
@@ -223,6 +234,1174 @@ namespace internal_tests {
         std::cerr << "ok!\n";
     }
 
+/* check move constructor, move assignment and in-place insertion */
+    void check_move() {
+        std::cerr << "check move semantics...\n";
+        StrangeInt::init();
+        {
+            HashMap<StrangeInt, std::string> first;
+            for (int i = 0; i < 100; ++i) {
+                first.try_emplace(i, std::to_string(i));
+            }
+            HashMap<StrangeInt, std::string> second(std::move(first));
+            if (second.size() != 100 || !first.empty())
+                fail("wrong move constructor");
+            first = std::move(second);
+            if (first.size() != 100 || !second.empty() || first.at(42) != "42")
+                fail("wrong move assignment");
+            second[7] = "seven";
+            first = std::move(second);
+            if (first.size() != 1 || first.at(7) != "seven")
+                fail("wrong move assignment");
+            std::vector<HashMap<StrangeInt, std::string>> maps;
+            maps.push_back(std::move(first));
+            maps.emplace_back(HashMap<StrangeInt, std::string>{{1, "a"}, {2, "b"}});
+            size_t count = 0;
+            for (const auto& element : maps[1]) {
+                count += element.second.size();
+            }
+            if (count != 2)
+                fail("wrong iteration after move");
+        }
+        if (StrangeInt::counter)
+            fail("wrong destructor (or constructors) after move");
+
+        HashMap<int, std::string> map;
+        if (!map.emplace(1, "one") || map.emplace(1, "uno"))
+            fail("wrong emplace");
+        if (map.try_emplace(1, "uno") || !map.try_emplace(2, 3, 'x'))
+            fail("wrong try_emplace");
+        if (map.insert_or_assign(1, "uno") || !map.insert_or_assign(3, "three"))
+            fail("wrong insert_or_assign");
+        std::string value = "four";
+        map.insert(std::make_pair(4, std::move(value)));
+        if (map[1] != "uno" || map[2] != "xxx" || map[3] != "three" || map[4] != "four")
+            fail("wrong values after emplace");
+
+        HashMap<std::string, int> by_name;
+        for (int i = 0; i < 1000; ++i) {
+            by_name[std::string(40, 'a') + std::to_string(i)] = i;
+        }
+        for (int i = 0; i < 1000; ++i) {
+            if (by_name.at(std::string(40, 'a') + std::to_string(i)) != i)
+                fail("wrong operator[] with a moved key");
+        }
+        std::cerr << "ok!\n";
+    }
+
+/* check that incremental resize keeps every element reachable while cells migrate */
+    void check_incremental_resize() {
+        std::cerr << "check incremental resize...\n";
+        HashMap<int, int> map;
+        map.set_incremental_resize(true);
+        std::unordered_map<int, int> expected;
+        for (int i = 0; i < 200000; ++i) {
+            int key = rand() % 100000;
+            if (rand() % 4 == 0) {
+                if (map.erase(key) != (expected.erase(key) == 1))
+                    fail("wrong erase while migrating");
+            } else {
+                map[key] = i;
+                expected[key] = i;
+            }
+            if (i % 101 == 0 && map.find(key) != map.end()) {
+                // lookups do not migrate, so a reference survives them
+                const int* value = &map.at(key);
+                for (int j = 0; j < 8; ++j) {
+                    int other = rand() % 100000;
+                    if (map.find(other) != map.end()) {
+                        ++map[other];
+                        ++expected[other];
+                    }
+                }
+                if (&map.at(key) != value)
+                    fail("lookup moved an element while migrating");
+            }
+            if (i % 20011 == 0) {
+                const auto& const_map = map;
+                size_t count = 0;
+                for (const auto& [k, v] : const_map) {
+                    ++count;
+                    if (expected.at(k) != v)
+                        fail("wrong value while migrating");
+                }
+                if (count != expected.size() || map.size() != expected.size())
+                    fail("wrong size while migrating");
+                for (const auto& [k, v] : expected) {
+                    if (const_map.at(k) != v)
+                        fail("element lost while migrating");
+                }
+            }
+        }
+        while (!expected.empty()) {
+            int key = expected.begin()->first;
+            expected.erase(expected.begin());
+            if (!map.erase(key))
+                fail("wrong erase while shrinking");
+        }
+        if (!map.empty() || map.begin() != map.end())
+            fail("map is not empty");
+        std::cerr << "ok!\n";
+    }
+
+/* a transparent hash lets string_view and C strings look up std::string keys */
+    void check_transparent() {
+        std::cerr << "check transparent lookup...\n";
+        struct StringHash {
+            using is_transparent = void;
+            size_t operator()(std::string_view s) const {
+                return std::hash<std::string_view>()(s);
+            }
+        };
+        HashMap<std::string, int, StringHash, std::equal_to<>> map;
+        for (int i = 0; i < 1000; ++i) {
+            map[std::to_string(i)] = i;
+        }
+        std::string buffer = "17 999 1000";
+        std::string_view first(buffer.data(), 2), second(buffer.data() + 3, 3), missing(buffer.data() + 7, 4);
+        if (map.find(first) == map.end() || map.find(first)->second != 17 || map.at(second) != 999)
+            fail("wrong transparent find");
+        if (!map.contains(second) || map.contains(missing) || map.count(first) != 1 || map.count(missing) != 0)
+            fail("wrong transparent contains");
+        if (map.find("500")->second != 500 || map.erase(missing) || !map.erase(first) || map.contains("17"))
+            fail("wrong transparent erase");
+        const auto& const_map = map;
+        if (const_map.find(second)->second != 999 || const_map.at(std::string_view("3")) != 3)
+            fail("wrong transparent const find");
+        std::cerr << "ok!\n";
+    }
+
+/* KeyEqual decides which keys are the same, a precomputed hash skips the hasher */
+    void check_key_equal() {
+        std::cerr << "check key equal and precomputed hashes...\n";
+        struct NoCaseHash {
+            size_t operator()(const std::string& s) const {
+                size_t hash = 0;
+                for (char c : s)
+                    hash = hash * 31 + std::tolower(static_cast<unsigned char>(c));
+                return hash;
+            }
+        };
+        struct NoCaseEqual {
+            bool operator()(const std::string& a, const std::string& b) const {
+                return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+                    return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+                });
+            }
+        };
+        HashMap<std::string, int, NoCaseHash, NoCaseEqual> headers;
+        headers["Content-Length"] = 10;
+        headers["content-length"] = 20;
+        if (headers.size() != 1 || headers.at("CONTENT-LENGTH") != 20 || headers.insert({"Content-length", 0}))
+            fail("wrong custom key equal");
+        HashMap<std::string, int, NoCaseHash, NoCaseEqual> copy = headers;
+        if (copy.find("content-LENGTH") == copy.end() || !copy.erase("Content-Length") || !copy.empty())
+            fail("wrong custom key equal after copy");
+
+        static size_t calls = 0;
+        auto counting_hash = [](int x) -> size_t {
+            ++calls;
+            return x;
+        };
+        HashMap<int, int, decltype(counting_hash)> map(counting_hash);
+        std::vector<size_t> hashes;
+        for (int i = 0; i < 100000; ++i)
+            hashes.push_back(map.hash_of(i));
+        for (int i = 0; i < 100000; ++i)
+            if (!map.insert({i, i}, hashes[i]))
+                fail("precomputed insert failed");
+        // only relocations while the nodes grow or shrink may still call the hasher
+        calls = 0;
+        const auto& const_map = map;
+        for (int i = 0; i < 100000; ++i)
+            if (map.find(i, hashes[i])->second != i || const_map.find(i, hashes[i]) == const_map.end() ||
+                !map.contains(i, hashes[i]))
+                fail("wrong precomputed find");
+        if (calls != 0)
+            fail("precomputed hash was recomputed");
+        for (int i = 0; i < 100000; i += 2)
+            if (!map.erase(i, hashes[i]))
+                fail("precomputed erase failed");
+        if (map.size() != 50000 || map.contains(0) || !map.contains(1))
+            fail("wrong size after precomputed erase");
+        std::cerr << "ok!\n";
+    }
+
+/* find_batch and contains_batch agree with find, in a settled map and while cells migrate */
+    void check_find_batch() {
+        std::cerr << "check batched lookup...\n";
+        for (bool incremental : {false, true}) {
+            HashMap<int, int> map;
+            map.set_incremental_resize(incremental);
+            const auto& const_map = map;
+            std::vector<int> keys;
+            for (int i = 0; i < 300000; ++i) {
+                map[i * 3] = i;
+                if (i % 1000 == 0) {
+                    keys.assign({i * 3, i * 3 + 1, 0, -5});
+                    std::vector<HashMap<int, int>::const_iterator> found;
+                    map.find_batch(keys.begin(), keys.end(), std::back_inserter(found));
+                    if (found.size() != 4 || found[0]->second != i || found[1] != const_map.end() ||
+                        found[2]->first != 0 || found[3] != const_map.end())
+                        fail("wrong find_batch while growing");
+                }
+            }
+            keys.clear();
+            for (int i = 0; i < 1000001; ++i)
+                keys.push_back(rand() % 1000000 - 100);
+            std::vector<char> contained(keys.size());
+            map.contains_batch(keys.begin(), keys.end(), contained.begin());
+            for (size_t i = 0; i < keys.size(); ++i)
+                if (static_cast<bool>(contained[i]) != map.contains(keys[i]))
+                    fail("wrong contains_batch");
+        }
+        HashMap<std::string, int> names{{"a", 1}, {"b", 2}};
+        std::vector<std::string> keys{"b", "c", "a"};
+        std::vector<bool> contained;
+        names.contains_batch(keys.begin(), keys.end(), std::back_inserter(contained));
+        if (contained != std::vector<bool>{true, false, true})
+            fail("wrong contains_batch in a leaf");
+        std::cerr << "ok!\n";
+    }
+
+/* find_interleaved reports every key once, with the result of find, whatever the number of probes in flight */
+    void check_find_interleaved() {
+        std::cerr << "check interleaved lookup...\n";
+        HashMap<int, int> map;
+        map.set_incremental_resize(true);
+        std::vector<int> keys;
+        for (int i = 0; i < 200000; ++i) {
+            map[i * 5] = i;
+            keys.push_back(rand() % 1000000);
+        }
+        const auto& const_map = map;
+        for (size_t in_flight : {0, 1, 7, 64, 1000}) {
+            std::vector<char> seen(keys.size());
+            size_t reported = 0;
+            const_map.find_interleaved(keys.begin(), keys.end(), [&](std::vector<int>::iterator key, auto it) {
+                ++reported;
+                seen[key - keys.begin()] += 1;
+                if (it != const_map.find(*key) || (it != const_map.end() && it->first != *key))
+                    fail("wrong find_interleaved result");
+            }, in_flight);
+            if (reported != keys.size() || std::count(seen.begin(), seen.end(), 1) != static_cast<long>(keys.size()))
+                fail("find_interleaved lost a key");
+        }
+        std::cerr << "ok!\n";
+    }
+
+/* writers and readers of different stripes at the same time, then a single-threaded check of the result */
+    void check_concurrent() {
+        std::cerr << "check concurrent map...\n";
+        const int threads = 4;
+        const int per_thread = 50000;
+        ConcurrentHashMap<int, int> map(16);
+        if (map.stripe_count() != 16 || ConcurrentHashMap<int, int>(20).stripe_count() != 32)
+            fail("wrong stripe count");
+        std::vector<std::thread> workers;
+        std::vector<int> misses(threads);
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                for (int i = t; i < threads * per_thread; i += threads) {
+                    map.insert({i, i});
+                    map.visit(i, [](int& value) {
+                        value += 1;
+                    });
+                    int value = 0;
+                    // the key of another writer may or may not be there yet, but never with a wrong value
+                    if (map.find(i ^ 1, value) && value != (i ^ 1) && value != (i ^ 1) + 1)
+                        ++misses[t];
+                    if (i % 3 == 0)
+                        map.erase(i);
+                }
+            });
+        }
+        for (auto& worker : workers)
+            worker.join();
+        for (int t = 0; t < threads; ++t)
+            if (misses[t])
+                fail("torn value in concurrent map");
+        size_t expected = 0;
+        for (int i = 0; i < threads * per_thread; ++i) {
+            int value = 0;
+            bool found = map.find(i, value);
+            if (found != (i % 3 != 0) || (found && value != i + 1))
+                fail("wrong element after concurrent writes");
+            expected += found;
+        }
+        size_t visited = 0;
+        map.for_each([&](const std::pair<const int, int>&) {
+            ++visited;
+        });
+        if (map.size() != expected || visited != expected || map.insert_or_assign(1, 7) || !map.insert_or_assign(0, 7))
+            fail("wrong size of concurrent map");
+        map.clear();
+        if (!map.empty() || map.contains(1))
+            fail("concurrent map is not empty");
+
+        ConcurrentHashMap<int, int, std::hash<int>, std::equal_to<int>, std::allocator<std::pair<const int, int>>,
+                LowMemoryPolicy> small(4);
+        for (int i = 0; i < 10000; ++i)
+            small.insert({i, i});
+        int value = 0;
+        if (small.size() != 10000 || !small.find(9999, value) || value != 9999)
+            fail("wrong concurrent map with a policy");
+        std::cerr << "ok!\n";
+    }
+
+/* lock-free readers against a writer that grows and shrinks the tree, then the same workload single-threaded */
+    void check_lock_free_reads() {
+        std::cerr << "check lock-free reads...\n";
+        LockFreeReadHashMap<int, int> map(4);
+        std::unordered_map<int, int> expected;
+        for (int i = 0; i < 200000; ++i) {
+            int key = rand() % 30000;
+            if (rand() % 3 == 0) {
+                if (map.erase(key) != (expected.erase(key) == 1))
+                    fail("wrong lock-free erase");
+            } else if (rand() % 2 == 0) {
+                if (map.insert({key, i}) != expected.emplace(key, i).second)
+                    fail("wrong lock-free insert");
+            } else {
+                if (map.insert_or_assign(key, i) == expected.count(key))
+                    fail("wrong lock-free insert_or_assign");
+                expected[key] = i;
+            }
+        }
+        size_t visited = 0;
+        map.for_each([&](const std::pair<const int, int>& element) {
+            ++visited;
+            if (expected.at(element.first) != element.second)
+                fail("wrong lock-free element");
+        });
+        if (map.size() != expected.size() || visited != expected.size())
+            fail("wrong lock-free size");
+        for (const auto& [key, value] : expected)
+            if (map.at(key) != value)
+                fail("lock-free element lost");
+
+        LockFreeReadHashMap<int, int> shared;
+        std::atomic<bool> stop{false};
+        std::vector<int> torn(3);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; ++t) {
+            readers.emplace_back([&, t] {
+                while (!stop.load()) {
+                    for (int key = 0; key < 20000; ++key) {
+                        int value = 0;
+                        if (shared.find(key, value) && value != 2 * key)
+                            ++torn[t];
+                    }
+                }
+            });
+        }
+        for (int round = 0; round < 5; ++round) {
+            for (int key = 0; key < 20000; ++key)
+                shared.insert({key, 2 * key});
+            for (int key = 0; key < 20000; ++key)
+                shared.erase(key);
+        }
+        stop.store(true);
+        for (auto& reader : readers)
+            reader.join();
+        if (std::count(torn.begin(), torn.end(), 0) != 3 || !shared.empty())
+            fail("wrong value seen by a lock-free reader");
+        epoch::Domain::Global().Reclaim();
+        if (epoch::Domain::Global().retired_size() != 0)
+            fail("retired nodes were not reclaimed");
+        bool thrown = false;
+        try {
+            shared.at(1);
+        } catch (const std::out_of_range&) {
+            thrown = true;
+        }
+        if (!thrown)
+            fail("lock-free at did not throw");
+
+        // writers retire into lists of their own, what they leave behind is reclaimed after they exit
+        LockFreeReadHashMap<int, int, std::hash<int>, std::equal_to<int>, LowMemoryPolicy> policy_map(4);
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t) {
+            writers.emplace_back([&, t] {
+                for (int key = t; key < 40000; key += 4)
+                    policy_map.insert({key, key});
+                for (int key = t; key < 40000; key += 8)
+                    policy_map.erase(key);
+            });
+        }
+        for (auto& writer : writers)
+            writer.join();
+        for (int key = 0; key < 40000; ++key) {
+            int value = -1;
+            if (policy_map.find(key, value) != (key % 8 >= 4) || (value != -1 && value != key))
+                fail("wrong lock-free map with a policy");
+        }
+        epoch::Domain::Global().Reclaim();
+        if (policy_map.size() != 20000 || epoch::Domain::Global().retired_size() != 0)
+            fail("retired nodes of exited writers were not reclaimed");
+        std::cerr << "ok!\n";
+    }
+
+/* batches spread over the shards and take every lock once, single keys from other threads meanwhile */
+    void check_sharded() {
+        std::cerr << "check sharded map...\n";
+        ShardedHashMap<int, int, std::hash<int>, 8> map;
+        std::vector<std::pair<int, int>> batch;
+        for (int i = 0; i < 100000; ++i)
+            batch.push_back({i, -i});
+        std::thread single([&] {
+            for (int i = 100000; i < 120000; ++i)
+                map.insert({i, -i});
+        });
+        if (map.insert_batch(batch.begin(), batch.end()) != batch.size() || map.insert_batch(batch.begin(), batch.begin() + 10))
+            fail("wrong insert_batch");
+        single.join();
+        auto stats = map.shard_stats();
+        size_t total = 0, acquisitions = 0;
+        for (const auto& shard : stats) {
+            total += shard.size;
+            acquisitions += shard.lock_acquisitions;
+            if (shard.size < 120000 / 8 / 2)
+                fail("shards are unbalanced");
+        }
+        // 20000 single inserts and two batches of at most 8 locks each
+        if (total != 120000 || map.size() != 120000 || acquisitions > 20000 + 16)
+            fail("wrong shard stats");
+        std::vector<int> keys;
+        for (int i = 0; i < 120000; i += 2)
+            keys.push_back(i);
+        if (map.erase_batch(keys.begin(), keys.end()) != keys.size() || map.erase_batch(keys.begin(), keys.end()))
+            fail("wrong erase_batch");
+        int value = 0;
+        if (map.contains(2) || !map.find(3, value) || value != -3 || map.insert_or_assign(3, 3) || !map.visit(3, [](int& v) {
+            v *= 2;
+        }) || !map.find(3, value) || value != 6)
+            fail("wrong single key operations");
+        size_t visited = 0;
+        map.for_each([&](const std::pair<const int, int>& element) {
+            visited += element.first % 2;
+        });
+        if (visited != 60000 || map.shard_of(3) >= map.shard_count())
+            fail("wrong sharded for_each");
+        map.reset_shard_stats();
+        map.clear();
+        if (!map.empty() || map.shard_stats()[0].lock_acquisitions != 1)
+            fail("sharded map is not empty");
+
+        // a batch of move-only values only compiles if the elements are moved, not copied
+        ConcurrentHashMap<int, std::unique_ptr<int>> owners(4);
+        std::vector<std::pair<int, std::unique_ptr<int>>> moved;
+        for (int i = 0; i < 1000; ++i)
+            moved.emplace_back(i, std::make_unique<int>(i));
+        if (owners.insert_batch(std::make_move_iterator(moved.begin()), std::make_move_iterator(moved.end())) != 1000 ||
+            moved[0].second || !owners.cvisit(999, [](const std::unique_ptr<int>& value) {
+            if (*value != 999)
+                fail("wrong moved value");
+        }))
+            fail("wrong insert_batch of moved elements");
+        size_t locks = 0;
+        for (const auto& stripe : owners.stripe_stats())
+            locks += stripe.lock_acquisitions;
+        // one lock per stripe for the batch, one for cvisit
+        if (locks != owners.stripe_count() + 1)
+            fail("wrong stripe stats");
+        std::cerr << "ok!\n";
+    }
+
+/* built on a pool it equals the map of one by one inserts: first of equal keys wins, and it stays usable */
+    void check_parallel_build() {
+        std::cerr << "check parallel build...\n";
+        ThreadPool pool(4);
+        std::vector<std::pair<int, std::string>> input;
+        for (int i = 0; i < 300000; ++i)
+            input.push_back({static_cast<int>(i * 7919ll % 200000), std::to_string(i)});
+        HashMap<int, std::string> map(input.begin(), input.end(), pool);
+        HashMap<int, std::string> sequential(input.begin(), input.end());
+        if (map.size() != 200000 || sequential.size() != 200000)
+            fail("wrong size after parallel build");
+        for (const auto& element : sequential) {
+            auto it = map.find(element.first);
+            if (it == map.end() || it->second != element.second)
+                fail("parallel build differs from inserts");
+        }
+        size_t iterated = 0;
+        for (const auto& element : map)
+            iterated += sequential.contains(element.first);
+        if (iterated != 200000)
+            fail("wrong iteration after parallel build");
+        for (int i = 0; i < 200000; i += 2)
+            map.erase(i);
+        for (int i = 200000; i < 300000; ++i)
+            map[i] = "new";
+        HashMap<int, std::string> copy = map;
+        HashMap<int, std::string> moved = std::move(map);
+        if (copy.size() != 200000 || moved.size() != 200000 || moved.contains(2) || moved.at(299999) != "new")
+            fail("wrong map after parallel build");
+        moved.clear();
+        std::vector<std::pair<int, std::string>> small(input.begin(), input.begin() + 100);
+        HashMap<int, std::string> from_small(small.begin(), small.end(), pool);
+        if (!moved.empty() || copy.at(1) != sequential.at(1) || from_small.size() != 100)
+            fail("wrong map after parallel build");
+        std::cerr << "ok!\n";
+    }
+
+/* parallel traversal sees every element once: leaf root, deep tree, root in the middle of a migration */
+    void check_parallel_traversal() {
+        std::cerr << "check parallel traversal...\n";
+        ThreadPool pool(4);
+        for (int n : {5, 300000}) {
+            for (bool incremental : {false, true}) {
+                HashMap<int, long long> map;
+                map.set_incremental_resize(incremental);
+                long long expected = 0;
+                for (int i = 0; i < n; ++i) {
+                    map[i] = i;
+                    expected += i;
+                }
+                map.for_each_parallel([](std::pair<const int, long long>& element) {
+                    element.second *= 2;
+                }, pool);
+                long long sum = map.transform_reduce(0ll, std::plus<>(), [](const std::pair<const int, long long>& element) {
+                    return element.second;
+                }, pool);
+                std::atomic<size_t> visited{0};
+                static_cast<const HashMap<int, long long>&>(map).for_each_parallel([&](const std::pair<const int, long long>&) {
+                    ++visited;
+                }, pool);
+                size_t odd = map.transform_reduce(size_t(0), std::plus<>(), [](const std::pair<const int, long long>& element) {
+                    return size_t(element.first % 2);
+                }, pool);
+                if (sum != 2 * expected || visited != size_t(n) || odd != size_t(n / 2))
+                    fail("wrong parallel traversal");
+            }
+        }
+        HashMap<int, int> map;
+        for (int i = 0; i < 100000; ++i)
+            map[i] = i;
+        bool thrown = false;
+        try {
+            map.for_each_parallel([](std::pair<const int, int>& element) {
+                if (element.first == 777)
+                    throw std::runtime_error("stop");
+            }, pool);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        HashMap<int, int> empty;
+        if (!thrown || empty.transform_reduce(7, std::plus<>(), [](const std::pair<const int, int>& element) {
+            return element.second;
+        }, pool) != 7)
+            fail("wrong parallel traversal");
+        std::cerr << "ok!\n";
+    }
+
+/* reserve jumps the root to its final size, so filling up to the reserved count never grows it again;
+ * rehash grows and shrinks it, both with and without incremental resize */
+    void check_reserve() {
+        std::cerr << "check reserve and rehash...\n";
+        for (bool incremental : {false, true}) {
+            HashMap<int, int> map;
+            map.set_incremental_resize(incremental);
+            map.reserve(2);
+            if (map.bucket_count() != 1 || map.load_factor() != 0)
+                fail("reserve of a few elements left the leaf");
+            map[-1] = -1;
+            map.reserve(100000);
+            size_t buckets = map.bucket_count();
+            if (buckets <= 400000 || map.size() != 1 || map.at(-1) != -1)
+                fail("wrong reserve");
+            for (int i = 0; i < 100000; ++i)
+                map[i] = i;
+            map.reserve(10);
+            if (map.bucket_count() != buckets || map.size() != 100001)
+                fail("reserve resized the map");
+            size_t total = 0;
+            for (size_t n = 0; n < map.bucket_count(); ++n)
+                total += map.bucket_size(n);
+            if (total != map.size() || map.load_factor() <= 0 || map.bucket_count() > map.max_bucket_count())
+                fail("wrong bucket sizes");
+            map.rehash(2 * buckets);
+            if (map.bucket_count() < 2 * buckets)
+                fail("rehash did not grow");
+            for (int i = 0; i < 99990; ++i)
+                map.erase(i);
+            map.rehash(0);
+            if (map.bucket_count() > 100 || map.size() != 11)
+                fail("rehash did not shrink");
+            for (int i = 99990; i < 100000; ++i)
+                if (map.at(i) != i)
+                    fail("wrong element after rehash");
+
+            // erases keep the reserved size, until clear
+            map.reserve(50000);
+            buckets = map.bucket_count();
+            for (int i = 0; i < 50000; ++i)
+                map[i] = i;
+            for (int i = 0; i < 50000; ++i)
+                map.erase(i);
+            if (map.bucket_count() != buckets || map.size() != 11)
+                fail("erase shrank a reserved map");
+            map.clear();
+            for (int i = 0; i < 1000; ++i)
+                map[i] = i;
+            for (int i = 0; i < 1000; ++i)
+                map.erase(i);
+            if (map.bucket_count() >= buckets)
+                fail("clear kept the reserved size");
+        }
+
+        // the buckets of a migrating root also count the elements still in its old cells
+        HashMap<int, int> migrating;
+        migrating.set_incremental_resize(true);
+        for (int i = 0; i < 5000; ++i) {
+            size_t buckets = migrating.bucket_count();
+            migrating[i] = i;
+            if (migrating.bucket_count() == buckets)
+                continue;
+            size_t total = 0;
+            for (size_t n = 0; n < migrating.bucket_count(); ++n)
+                total += migrating.bucket_size(n);
+            if (total != migrating.size())
+                fail("wrong bucket sizes while migrating");
+        }
+        std::cerr << "ok!\n";
+    }
+
+    struct UnseededLowLatencyPolicy : LowLatencyPolicy {
+        static constexpr bool SEEDED_HASH = false;
+    };
+
+    struct UnseededLowMemoryPolicy : LowMemoryPolicy {
+        static constexpr bool SEEDED_HASH = false;
+    };
+
+/* a policy changes the shape of the tree, never the contents: random operations against std::unordered_map,
+ * plus hashes that collide in the root so that the deeper levels of each policy are used */
+    template<class Policy>
+    void check_policy() {
+        HashMap<int, int, std::hash<int>, std::equal_to<int>, std::allocator<std::pair<const int, int>>, Policy> map;
+        std::unordered_map<int, int> expected;
+        for (int i = 0; i < 200000; ++i) {
+            int key = rand() % 50000;
+            if (rand() % 3 == 0) {
+                if (map.erase(key) != (expected.erase(key) == 1))
+                    fail("wrong erase with a policy");
+            } else {
+                map[key] = i;
+                expected[key] = i;
+            }
+        }
+        if (map.size() != expected.size())
+            fail("wrong size with a policy");
+        for (const auto& element : expected)
+            if (map.at(element.first) != element.second)
+                fail("wrong value with a policy");
+        auto few_cells = [](int x) -> size_t {
+            return static_cast<size_t>(x % 3) << 40;
+        };
+        HashMap<int, int, decltype(few_cells), std::equal_to<int>, std::allocator<std::pair<const int, int>>, Policy>
+                deep(few_cells);
+        for (int i = 0; i < 1000; ++i)
+            deep[i] = i;
+        for (int i = 0; i < 1000; i += 2)
+            deep.erase(i);
+        for (int i = 0; i < 1000; ++i)
+            if (deep.contains(i) != (i % 2 == 1))
+                fail("wrong deep map with a policy");
+    }
+
+    void check_policies() {
+        std::cerr << "check policies...\n";
+        check_policy<DefaultPolicy>();
+        check_policy<LowLatencyPolicy>();
+        check_policy<LowMemoryPolicy>();
+        // unseeded, so that the root sizes do not depend on the seeds of the maps
+        HashMap<int, int, std::hash<int>, std::equal_to<int>, std::allocator<std::pair<const int, int>>, UnseededPolicy> normal;
+        HashMap<int, int, std::hash<int>, std::equal_to<int>, std::allocator<std::pair<const int, int>>, UnseededLowLatencyPolicy> fast;
+        HashMap<int, int, std::hash<int>, std::equal_to<int>, std::allocator<std::pair<const int, int>>, UnseededLowMemoryPolicy> small;
+        for (int i = 0; i < 100000; ++i) {
+            normal[i] = fast[i] = small[i] = i;
+        }
+        if (!(small.bucket_count() < normal.bucket_count() && normal.bucket_count() < fast.bucket_count()))
+            fail("wrong root sizes of the policies");
+        for (uint8_t level = 0; level < LowMemoryPolicy::MAX_RECURSIVE_LEVEL; ++level)
+            for (uint8_t id = 0; id < LowMemoryPolicy::MAX_SIZE_ID; ++id)
+                if (ModMaxSize<LowMemoryPolicy>(UINT32_MAX, level, id) != UINT32_MAX % LowMemoryPolicy::max_sizes[level][id])
+                    fail("wrong ModMaxSize with a policy");
+        std::cerr << "ok!\n";
+    }
+
+/* keys whose hashes all collide end in one unbounded last level leaf: it is searched through a tree of its keys,
+ * iterated past 255 elements, and keys that operator< does not tell apart stay distinct */
+    void check_sorted_leaf() {
+        std::cerr << "check sorted last level leaf...\n";
+        auto zero_hash = [](int) -> size_t {
+            return 0;
+        };
+        HashMap<int, int, decltype(zero_hash)> map(zero_hash);
+        std::unordered_map<int, int> expected;
+        for (int i = 0; i < 20000; ++i) {
+            int key = rand() % 3000;
+            if (rand() % 3 == 0) {
+                if (map.erase(key) != (expected.erase(key) == 1))
+                    fail("wrong erase in a sorted leaf");
+            } else {
+                map[key] = i;
+                expected[key] = i;
+            }
+        }
+        std::vector<int> keys;
+        for (const auto& element : map)
+            keys.push_back(element.first);
+        std::sort(keys.begin(), keys.end());
+        if (keys.size() != expected.size() || map.size() != expected.size() ||
+            std::adjacent_find(keys.begin(), keys.end()) != keys.end())
+            fail("wrong elements of a sorted leaf");
+        for (int key = -1; key <= 3000; ++key) {
+            auto it = map.find(key);
+            if ((it != map.end()) != (expected.count(key) == 1) || (it != map.end() && it->second != expected[key]))
+                fail("wrong find in a sorted leaf");
+        }
+        struct ZeroHash {
+            using is_transparent = void;
+            size_t operator()(std::string_view) const {
+                return 0;
+            }
+        };
+        HashMap<std::string, int, ZeroHash, std::equal_to<>> strings;
+        for (int i = 999; i >= 0; --i)
+            strings.emplace(std::to_string(i), i);
+        if (strings.size() != 1000 || !strings.contains(std::string_view("500")) || strings.contains(std::string_view("1000")) ||
+            strings.find(std::string("7"))->second != 7 || !strings.erase(std::string_view("7")) || strings.contains(std::string("7")))
+            fail("wrong sorted leaf of strings");
+
+        struct TaggedKey {
+            int id;
+            int tag;
+
+            bool operator==(const TaggedKey& other) const {
+                return id == other.id && tag == other.tag;
+            }
+            bool operator<(const TaggedKey& other) const {
+                return id < other.id;
+            }
+        };
+        auto constant_hash = [](const TaggedKey&) -> size_t {
+            return 0;
+        };
+        HashMap<TaggedKey, int, decltype(constant_hash)> tagged(constant_hash);
+        for (int i = 0; i < 100; ++i)
+            tagged.emplace(TaggedKey{i / 2, i % 2}, i);
+        if (tagged.size() != 100)
+            fail("keys equivalent for operator< are merged");
+        for (int i = 0; i < 100; ++i)
+            if (!tagged.contains(TaggedKey{i / 2, i % 2}) || tagged.at(TaggedKey{i / 2, i % 2}) != i)
+                fail("wrong find of keys equivalent for operator<");
+        for (int i = 0; i < 100; i += 2)
+            tagged.erase(TaggedKey{i / 2, 0});
+        if (tagged.size() != 50 || tagged.contains(TaggedKey{3, 0}) || tagged.at(TaggedKey{3, 1}) != 7)
+            fail("wrong erase of keys equivalent for operator<");
+        for (int i = 0; i < 100; i += 2)
+            tagged.erase(TaggedKey{i / 2, 1});
+        tagged.emplace(TaggedKey{1, 1}, 1);
+        if (tagged.size() != 1 || !tagged.contains(TaggedKey{1, 1}) || tagged.contains(TaggedKey{1, 0}))
+            fail("wrong leaf after its tree is dropped");
+        std::cerr << "ok!\n";
+    }
+
+/* keys prepared to share one root cell of an unseeded map (identity std::hash<int>) scatter in a seeded one,
+ * and two seeded maps place the same keys differently */
+    void check_seeded_hash() {
+        std::cerr << "check seeded hash...\n";
+        using Unseeded = HashMap<long long, int, std::hash<long long>, std::equal_to<long long>,
+                                 std::allocator<std::pair<const long long, int>>, UnseededPolicy>;
+        Unseeded unseeded;
+        HashMap<long long, int> seeded;
+        unseeded.reserve(2000);
+        seeded.reserve(2000);
+        uint8_t id = 0;
+        while (max_sizes[id] != unseeded.bucket_count())
+            ++id;
+        std::vector<long long> keys;
+        for (long long x = 0; keys.size() < 2000; ++x)
+            if (ModMaxSize(static_cast<uint32_t>((static_cast<uint64_t>(x) * level_multipliers[0]) >> 32), id) == 0)
+                keys.push_back(x);
+        for (long long key : keys)
+            unseeded[key] = seeded[key] = 1;
+        size_t largest = 0;
+        for (size_t n = 0; n < seeded.bucket_count(); ++n)
+            largest = std::max(largest, seeded.bucket_size(n));
+        if (unseeded.bucket_size(0) != keys.size() || seeded.bucket_count() != unseeded.bucket_count() || largest > 10)
+            fail("seeded map did not scatter prepared keys");
+        HashMap<long long, int> other;
+        other.reserve(2000);
+        for (long long key : keys)
+            other[key] = 1;
+        bool differ = false;
+        for (size_t n = 0; n < seeded.bucket_count(); ++n)
+            differ |= seeded.bucket_size(n) != other.bucket_size(n);
+        HashMap<long long, int> copy = seeded;
+        if (!differ || copy.size() != seeded.size() || !copy.contains(keys.back()))
+            fail("maps share a seed");
+        std::cerr << "ok!\n";
+    }
+
+/* iteration over a sparse reserved map and over a map in the middle of an incremental resize visits every
+ * element once, while cells are filled, emptied and migrated */
+    void check_sparse_iteration() {
+        std::cerr << "check sparse iteration...\n";
+        for (bool incremental : {false, true}) {
+            HashMap<int, int> map;
+            map.set_incremental_resize(incremental);
+            map.reserve(200000);
+            std::unordered_map<int, int> expected;
+            for (int round = 0; round < 6; ++round) {
+                for (int i = 0; i < 3000; ++i) {
+                    int key = (round * 3000 + i) * 7919;
+                    map[key] = i;
+                    expected[key] = i;
+                }
+                for (int i = 0; i < 3000; i += 2) {
+                    int key = (round * 3000 + i) * 7919;
+                    map.erase(key);
+                    expected.erase(key);
+                }
+                size_t visited = 0, const_visited = 0;
+                long long sum = 0, expected_sum = 0;
+                for (auto& element : map) {
+                    ++visited;
+                    sum += element.first;
+                }
+                const HashMap<int, int>& view = map;
+                for (auto it = view.begin(); it != view.end(); ++it)
+                    ++const_visited;
+                for (const auto& element : expected)
+                    expected_sum += element.first;
+                if (visited != expected.size() || const_visited != expected.size() || sum != expected_sum)
+                    fail("sparse iteration missed elements");
+            }
+            for (auto& element : expected)
+                map.erase(element.first);
+            if (!map.empty() || map.begin() != map.end())
+                fail("iteration of an emptied map");
+        }
+        std::cerr << "ok!\n";
+    }
+
+/* compact nodes hold the same contents as nodes with a pointer per cell: every node compact (the root too,
+ * through incremental resize) and none compact */
+    struct FullNodesPolicy : DefaultPolicy {
+        static constexpr size_t COMPACT_MAX_CELLS = 0;
+    };
+
+    struct CompactNodesPolicy : DefaultPolicy {
+        static constexpr size_t COMPACT_MAX_CELLS = SIZE_MAX;
+    };
+
+    void check_compact_nodes() {
+        std::cerr << "check compact nodes...\n";
+        check_policy<FullNodesPolicy>();
+        check_policy<CompactNodesPolicy>();
+        for (bool incremental : {false, true}) {
+            HashMap<int, int, std::hash<int>, std::equal_to<int>, std::allocator<std::pair<const int, int>>,
+                    CompactNodesPolicy> map;
+            map.set_incremental_resize(incremental);
+            std::unordered_map<int, int> expected;
+            for (int i = 0; i < 60000; ++i) {
+                int key = rand() % 20000;
+                if (i > 30000 && rand() % 2 == 0) {
+                    if (map.erase(key) != (expected.erase(key) == 1))
+                        fail("wrong erase in a compact node");
+                } else {
+                    map[key] = i;
+                    expected[key] = i;
+                }
+                if (i % 5000 == 0) {
+                    size_t visited = 0;
+                    for (const auto& element : map) {
+                        ++visited;
+                        if (expected.at(element.first) != element.second)
+                            fail("wrong element in a compact node");
+                    }
+                    if (visited != expected.size())
+                        fail("wrong iteration of compact nodes");
+                }
+            }
+            std::vector<int> keys;
+            for (int key = 0; key < 20000; ++key)
+                keys.push_back(key);
+            std::vector<char> contained(keys.size());
+            map.contains_batch(keys.begin(), keys.end(), contained.begin());
+            for (int key : keys)
+                if (static_cast<bool>(contained[key]) != (expected.count(key) == 1))
+                    fail("wrong batch lookup in a compact node");
+        }
+        std::cerr << "ok!\n";
+    }
+
+/* the hash is computed once per lookup, whatever the depth of the key */
+    void check_hash_once() {
+        std::cerr << "check hash calls...\n";
+        static size_t calls = 0;
+        auto counting_hash = [](int x) -> size_t {
+            ++calls;
+            return x % 1000;
+        };
+        HashMap<int, int, decltype(counting_hash)> map(counting_hash);
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i;
+        }
+        calls = 0;
+        for (int i = 0; i < 200000; ++i) {
+            map.find(i);
+            map.at(i % 100000);
+        }
+        if (calls != 400000)
+            fail("hash is computed more than once per lookup");
+        std::cerr << "ok!\n";
+    }
+
+/* the multiply-shift reduction must put every hash in the same cell as % did */
+    void check_fast_mod() {
+        std::cerr << "check cell reduction...\n";
+        for (uint8_t id = 0; id < MAX_SIZE_ID; ++id) {
+            for (uint32_t value : {0u, 1u, static_cast<uint32_t>(max_sizes[id] - 1), static_cast<uint32_t>(max_sizes[id]),
+                                   static_cast<uint32_t>(max_sizes[id] + 1), UINT32_MAX - 1, UINT32_MAX}) {
+                if (ModMaxSize(value, id) != value % max_sizes[id])
+                    fail("wrong cell reduction");
+            }
+            for (int i = 0; i < 100000; ++i) {
+                uint32_t value = static_cast<uint32_t>(rand()) * 2654435761u + static_cast<uint32_t>(rand());
+                if (ModMaxSize(value, id) != value % max_sizes[id])
+                    fail("wrong cell reduction");
+            }
+        }
+        std::cerr << "ok!\n";
+    }
+
+/* keys of 4 and 8 bytes are scanned with SIMD: check leaves of every size, including
+ * the unbounded last level leaf that a constant hash produces */
+    template<class KeyType>
+    void check_leaf_scan() {
+        auto constant_hash = [](KeyType) -> size_t {
+            return 7;
+        };
+        HashMap<KeyType, int, decltype(constant_hash)> map(constant_hash);
+        for (int i = 0; i < 300; ++i) {
+            map[static_cast<KeyType>(i) * 1000003] = i;
+            for (int j = 0; j <= i + 1; ++j) {
+                auto it = map.find(static_cast<KeyType>(j) * 1000003);
+                if ((it != map.end()) != (j <= i) || (j <= i && it->second != j))
+                    fail("wrong find in a leaf");
+            }
+        }
+        for (int i = 0; i < 300; i += 2) {
+            if (!map.erase(static_cast<KeyType>(i) * 1000003))
+                fail("wrong erase in a leaf");
+        }
+        for (int i = 0; i < 300; ++i) {
+            if ((map.find(static_cast<KeyType>(i) * 1000003) != map.end()) != (i % 2 == 1))
+                fail("wrong find after erase in a leaf");
+        }
+        HashMap<KeyType, int> small;
+        for (int i = 0; i < 3; ++i) {
+            small[static_cast<KeyType>(-i)] = i;
+        }
+        if (small.find(static_cast<KeyType>(-3)) != small.end() || small.at(static_cast<KeyType>(-2)) != 2)
+            fail("wrong find in a small map");
+    }
+
+/* other keys are filtered by 8-bit hash tags: elements with equal tags must still be told apart */
+    void check_leaf_tags() {
+        auto few_tags = [](const std::string& s) -> size_t {
+            return std::hash<std::string>()(s) % 5;
+        };
+        HashMap<std::string, int, decltype(few_tags)> map(few_tags);
+        std::unordered_map<std::string, int> expected;
+        for (int i = 0; i < 20000; ++i) {
+            std::string key = std::to_string(rand() % 500);
+            if (rand() % 3 == 0) {
+                if (map.erase(key) != (expected.erase(key) == 1))
+                    fail("wrong erase with equal tags");
+            } else {
+                map[key] = i;
+                expected[key] = i;
+            }
+        }
+        for (int i = 0; i < 500; ++i) {
+            std::string key = std::to_string(i);
+            auto it = map.find(key);
+            if ((it != map.end()) != (expected.count(key) == 1) || (it != map.end() && it->second != expected[key]))
+                fail("wrong find with equal tags");
+        }
+    }
+
+    void check_simd_keys() {
+        std::cerr << "check leaf scans...\n";
+        check_leaf_scan<int>();
+        check_leaf_scan<long long>();
+        check_leaf_scan<unsigned>();
+        check_leaf_tags();
+        std::cerr << "ok!\n";
+    }
+
+/* memory resource that remembers how many bytes are still allocated from it */
+    struct CountingResource : std::pmr::memory_resource {
+        size_t outstanding = 0;
+
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            outstanding += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override {
+            outstanding -= bytes;
+            std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+/* check that all memory goes through the allocator and pmr maps propagate their resource */
+    void check_allocator() {
+        std::cerr << "check allocator...\n";
+        CountingResource first_resource, second_resource;
+        {
+            pmr::HashMap<int, std::pmr::string> first(&first_resource);
+            for (int i = 0; i < 10000; ++i) {
+                first.try_emplace(i, std::to_string(i) + " is long enough to leave the small string buffer");
+            }
+            if (first_resource.outstanding == 0)
+                fail("nothing allocated from the resource");
+            if (first.at(17).get_allocator().resource() != &first_resource)
+                fail("resource is not propagated to the elements");
+
+            pmr::HashMap<int, std::pmr::string> second(&second_resource);
+            second = std::move(first);
+            if (second.size() != 10000 || second.get_allocator().resource() != &second_resource)
+                fail("wrong move assignment between resources");
+            if (second.at(17).get_allocator().resource() != &second_resource)
+                fail("element moved to another resource keeps the old one");
+            pmr::HashMap<int, std::pmr::string> copy(second, &first_resource);
+            if (copy.size() != 10000 || copy.at(9999) != second.at(9999))
+                fail("wrong copy with allocator");
+            pmr::HashMap<int, std::pmr::string> moved(std::move(copy));
+            if (moved.get_allocator().resource() != &first_resource || moved.size() != 10000)
+                fail("wrong move constructor");
+        }
+        if (first_resource.outstanding != 0 || second_resource.outstanding != 0)
+            fail("memory is not returned to the resource");
+
+        char buffer[1 << 16];
+        std::pmr::monotonic_buffer_resource request(buffer, sizeof(buffer));
+        pmr::HashMap<int, int> map(&request);
+        for (int i = 0; i < 100; ++i) {
+            map[i] = i;
+        }
+        if (map.size() != 100 || map[99] != 99)
+            fail("wrong map in a monotonic buffer");
+
+        using PmrAllocator = std::pmr::polymorphic_allocator<std::pair<const int, int>>;
+        CountingResource striped_resource, sharded_resource;
+        {
+            ConcurrentHashMap<int, int, std::hash<int>, std::equal_to<int>, PmrAllocator> striped(
+                    4, {}, {}, &striped_resource);
+            ShardedHashMap<int, int, std::hash<int>, 8, std::equal_to<int>, PmrAllocator> sharded(
+                    {}, {}, &sharded_resource);
+            for (int i = 0; i < 10000; ++i) {
+                striped.insert({i, i});
+                sharded.insert({i, i});
+            }
+            if (striped_resource.outstanding == 0 || sharded_resource.outstanding == 0)
+                fail("stripes do not allocate from the resource");
+        }
+        if (striped_resource.outstanding != 0 || sharded_resource.outstanding != 0)
+            fail("stripes do not return memory to the resource");
+        std::cerr << "ok!\n";
+    }
+
+/* values aligned past the arena granule still get aligned storage, in leaves and in big blocks, and values
+ * aligned to a good part of a slab do not overrun it */
+    struct alignas(64) CacheLine {
+        int value = 0;
+    };
+
+    struct alignas(4096) Page {
+        int value = 0;
+    };
+
+    void check_over_aligned() {
+        std::cerr << "check over-aligned values...\n";
+        HashMap<int, CacheLine> map;
+        for (int i = 0; i < 50000; ++i) {
+            map[i].value = i;
+            if (i % 1000 == 0)
+                for (const auto& element : map)
+                    if (reinterpret_cast<uintptr_t>(&element.second) % alignof(CacheLine) != 0)
+                        fail("misaligned value");
+        }
+        for (const auto& element : map)
+            if (reinterpret_cast<uintptr_t>(&element.second) % alignof(CacheLine) != 0 ||
+                element.second.value != element.first)
+                fail("wrong over-aligned value");
+
+        HashMap<int, Page> pages;
+        for (int i = 0; i < 2000; ++i)
+            pages[i].value = i;
+        for (const auto& element : pages)
+            if (reinterpret_cast<uintptr_t>(&element.second) % alignof(Page) != 0 || element.second.value != element.first)
+                fail("wrong page-aligned value");
+        std::cerr << "ok!\n";
+    }
+
+/* the nodes share the state of the map through its root: a map moved while its root migrates iterates and
+ * erases the old cells as well, and a tree of small leaves stays within a few cache lines per element */
+    void check_node_header() {
+        std::cerr << "check node header...\n";
+        HashMap<int, int> source;
+        source.set_incremental_resize(true);
+        std::unordered_map<int, int> expected;
+        for (int i = 0; i < 20000; ++i) {
+            source[i * 7] = i;
+            expected[i * 7] = i;
+            if (i % 997 != 0)
+                continue;
+            HashMap<int, int> moved(std::move(source));
+            for (int j = 0; j < 10; ++j) {
+                int key = rand() % (i + 1) * 7;
+                if (moved.erase(key) != (expected.erase(key) == 1))
+                    fail("wrong erase after a move during migration");
+            }
+            size_t visited = 0;
+            for (const auto& element : moved) {
+                ++visited;
+                if (expected.at(element.first) != element.second)
+                    fail("wrong element after a move during migration");
+            }
+            if (visited != expected.size() || moved.size() != expected.size())
+                fail("wrong iteration after a move during migration");
+            source = std::move(moved);
+        }
+        for (const auto& element : expected)
+            if (source.at(element.first) != element.second)
+                fail("wrong lookup after moves during migration");
+
+        CountingResource resource;
+        pmr::HashMap<int, int> map(&resource);
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i;
+        }
+        if (resource.outstanding / map.size() > 176)
+            fail("too much memory per element");
+
+        CountingResource single_resource;
+        pmr::HashMap<int, int> single(&single_resource);
+        single[1] = 1;
+        if (single_resource.outstanding > 1024)
+            fail("too much memory for a single element");
+        std::cerr << "ok!\n";
+    }
+
 /* check if iterator and const_iterator are implemented correctly */
     void check_iterators() {
         std::cerr << "check iterators...\n";
@@ -269,6 +1448,29 @@ namespace internal_tests {
         hash_check();
         check_destructor();
         check_copy();
+        check_move();
+        check_incremental_resize();
+        check_hash_once();
+        check_transparent();
+        check_key_equal();
+        check_find_batch();
+        check_find_interleaved();
+        check_concurrent();
+        check_lock_free_reads();
+        check_sharded();
+        check_parallel_build();
+        check_parallel_traversal();
+        check_reserve();
+        check_policies();
+        check_sorted_leaf();
+        check_seeded_hash();
+        check_sparse_iteration();
+        check_compact_nodes();
+        check_node_header();
+        check_fast_mod();
+        check_simd_keys();
+        check_allocator();
+        check_over_aligned();
         check_iterators();
     }
 } // namespace internal_tests